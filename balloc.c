@@ -0,0 +1,888 @@
+/* balloc.c: block groups, inode and data block allocation
+ *
+ * The volume is split into groups, each with a block bitmap, an inode
+ * bitmap and a slice of the inode table, under a lock of its own. Data
+ * goes near the block before it in the file, or into the group of its
+ * inode; new directories are spread over the groups (Orlov), other
+ * inodes stay in the group of their directory.
+ *
+ * Each cpu reserves a short run of free blocks from a group at a time
+ * and hands them out in a row without the group lock; the leftovers go
+ * back when the cpu moves to another group, when the volume runs full
+ * and at umount. The run is only reserved in memory, the blocks handed
+ * out are set in the bitmap in a batch before an inode pointing to them
+ * is written, before bits are cleared in the group and when the run
+ * ends, so a crash loses none of it.
+ *
+ * This file is released under the GPL.
+ */
+
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include "internal.h"
+
+static inline gzafs_sb_info *SBINFO(struct super_block *sb)
+{
+	return &((struct ramfs_fs_info *)sb->s_fs_info)->sbinfo;
+}
+
+/**
+ * bitmaps and inode table at the head of each group
+ */
+u32 zramfs_group_meta_blocks(gzafs_sb_info *sbinfo)
+{
+	return 2 + sbinfo->itable_block_num;
+}
+
+static loff_t bitmap_offset(struct super_block *sb, u32 block)
+{
+	return (loff_t)block * SBINFO(sb)->block_size;
+}
+
+static u32 group_of_block(gzafs_sb_info *sbinfo, u32 block)
+{
+	return (block - sbinfo->first_group_block) / sbinfo->blocks_per_group;
+}
+
+loff_t zramfs_inode_offset(struct super_block *sb, u32 ino)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	struct zramfs_group *grp = zramfs_group(fsi, ino / sbinfo->inodes_per_group);
+
+	return (loff_t)grp->desc.inode_table * sbinfo->block_size +
+		(loff_t)(ino % sbinfo->inodes_per_group) * zramfs_inode_size(sbinfo);
+}
+
+/**
+ * write the descriptor of a group back, synchronously for the uninit
+ * flags and the inode table watermark, which must not go back in time
+ */
+int zramfs_write_group_desc(struct super_block *sb, u32 group, int sync)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct block_device *bdev = sb->s_bdev;
+	loff_t offset = bitmap_offset(sb, fsi->sbinfo.gdt_begin) +
+		group * sizeof(struct zramfs_group_desc);
+	struct buffer_head *bh;
+	int err = 0;
+
+	bh = __bread(bdev, offset >> bdev->bd_inode->i_blkbits, bdev->bd_block_size);
+	if (!bh)
+		return -EIO;
+	memcpy(bh->b_data + (offset & (bdev->bd_block_size - 1)),
+			&zramfs_group(fsi, group)->desc, sizeof(struct zramfs_group_desc));
+	mark_buffer_dirty(bh);
+	if (sync) {
+		sync_dirty_buffer(bh);
+		if (!buffer_uptodate(bh))
+			err = -EIO;
+	}
+	brelse(bh);
+	return err;
+}
+
+/*
+ * allocate the chunks holding groups [0, count), a chunk once there stays
+ * where it is
+ */
+static int zramfs_alloc_groups(struct ramfs_fs_info *fsi, u32 count)
+{
+	u32 c;
+
+	for (c = 0; c < DIV_ROUND_UP(count, ZRAMFS_GROUPS_PER_CHUNK); c++) {
+		if (fsi->groups[c])
+			continue;
+		fsi->groups[c] = kzalloc(ZRAMFS_GROUPS_PER_CHUNK * sizeof(struct zramfs_group), GFP_KERNEL);
+		if (!fsi->groups[c])
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * read the group descriptors and count the free blocks and inodes of
+ * each group from its bitmaps
+ */
+int zramfs_load_groups(struct super_block *sb)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	u32 count = sbinfo->group_count;
+	struct zramfs_group *grp;
+	size_t len;
+	int cpu;
+	int err;
+	u32 g;
+
+	if (!count || sbinfo->blocks_per_group > sbinfo->block_size * 8 ||
+			sbinfo->inodes_per_group > sbinfo->block_size * 8 ||
+			(zramfs_inode_size(sbinfo) != INODE_SIZE && zramfs_inode_size(sbinfo) != INODE_SIZE_V2) ||
+			(u64)sbinfo->inodes_per_group * zramfs_inode_size(sbinfo) >
+				(u64)sbinfo->itable_block_num * sbinfo->block_size ||
+			sbinfo->first_group_block + (u64)(count - 1) * sbinfo->blocks_per_group >= sbinfo->block_num) {
+		printk(KERN_ERR "zramfs: bad group layout, groups:%u, blocks per group:%u\n",
+				count, sbinfo->blocks_per_group);
+		return -EINVAL;
+	}
+	//chunk pointers for every group an online resize may add, the chunks
+	//themselves only for the groups in use
+	fsi->group_max = max_t(u64, count, (u64)sbinfo->gdt_block_num * sbinfo->block_size /
+			sizeof(struct zramfs_group_desc));
+	len = DIV_ROUND_UP(fsi->group_max, ZRAMFS_GROUPS_PER_CHUNK) * sizeof(struct zramfs_group *);
+	//a multi-terabyte volume has a lot of groups
+	if (len > PAGE_SIZE)
+		fsi->groups = vmalloc(len);
+	else
+		fsi->groups = kmalloc(len, GFP_KERNEL);
+	if (!fsi->groups)
+		return -ENOMEM;
+	memset(fsi->groups, 0, len);
+	err = zramfs_alloc_groups(fsi, count);
+	if (err)
+		return err;
+	fsi->pools = alloc_percpu(struct zramfs_pool);
+	if (!fsi->pools)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		spin_lock_init(&per_cpu_ptr(fsi->pools, cpu)->lock);
+		INIT_LIST_HEAD(&per_cpu_ptr(fsi->pools, cpu)->list);
+	}
+	for (g = 0; g < count; g++) {
+		grp = zramfs_group(fsi, g);
+		mutex_init(&grp->lock);
+		INIT_LIST_HEAD(&grp->pools);
+		get_dev_content(sb->s_bdev, bitmap_offset(sb, sbinfo->gdt_begin) + g * sizeof(grp->desc),
+				(char *)&grp->desc, sizeof(grp->desc));
+		grp->begin = sbinfo->first_group_block + g * sbinfo->blocks_per_group;
+		grp->block_count = min(sbinfo->blocks_per_group, sbinfo->block_num - grp->begin);
+		if (grp->desc.flags & ZRAMFS_BG_BLOCK_UNINIT)
+			grp->free_blocks = grp->block_count - zramfs_group_meta_blocks(sbinfo);
+		else
+			grp->free_blocks = grp->block_count - count_dev_bits(sb->s_bdev,
+					bitmap_offset(sb, grp->desc.block_bitmap), grp->block_count);
+		if (grp->desc.flags & ZRAMFS_BG_INODE_UNINIT)
+			grp->free_inodes = sbinfo->inodes_per_group;
+		else
+			grp->free_inodes = sbinfo->inodes_per_group - count_dev_bits(sb->s_bdev,
+					bitmap_offset(sb, grp->desc.inode_bitmap), sbinfo->inodes_per_group);
+	}
+	return 0;
+}
+
+void zramfs_put_groups(struct super_block *sb)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	u32 c;
+
+	if (fsi->pools) {
+		zramfs_drain_pools(sb);
+		free_percpu(fsi->pools);
+		fsi->pools = NULL;
+	}
+	if (!fsi->groups)
+		return;
+	for (c = 0; c < DIV_ROUND_UP(fsi->group_max, ZRAMFS_GROUPS_PER_CHUNK); c++)
+		kfree(fsi->groups[c]);
+	if (is_vmalloc_addr(fsi->groups))
+		vfree(fsi->groups);
+	else
+		kfree(fsi->groups);
+	fsi->groups = NULL;
+}
+
+/*
+ * set up group g of a volume growing to end blocks, its bitmaps and inode
+ * table left for lazyinit.c, and write its descriptor
+ */
+static int zramfs_add_group(struct super_block *sb, u32 g, u64 end)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	struct zramfs_group *grp = zramfs_group(fsi, g);
+
+	memset(grp, 0, sizeof(*grp));
+	mutex_init(&grp->lock);
+	INIT_LIST_HEAD(&grp->pools);
+	grp->begin = sbinfo->first_group_block + g * sbinfo->blocks_per_group;
+	grp->block_count = min_t(u64, sbinfo->blocks_per_group, end - grp->begin);
+	grp->desc.block_bitmap = grp->begin;
+	grp->desc.inode_bitmap = grp->begin + 1;
+	grp->desc.inode_table = grp->begin + 2;
+	grp->desc.flags = ZRAMFS_BG_BLOCK_UNINIT | ZRAMFS_BG_INODE_UNINIT;
+	grp->free_blocks = grp->block_count - zramfs_group_meta_blocks(sbinfo);
+	grp->free_inodes = sbinfo->inodes_per_group;
+	return zramfs_write_group_desc(sb, g, 1);
+}
+
+/**
+ * grow a mounted volume to *blocks, the whole device when it is 0. the
+ * short last group fills up first, then groups are appended in the room
+ * format.c left in the descriptor table. the super block is the commit
+ * point, a crash before it leaves the old size. *blocks gets the new size.
+ */
+int zramfs_resize_fs(struct super_block *sb, u64 *blocks)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	u32 meta = zramfs_group_meta_blocks(sbinfo);
+	u32 bpg = sbinfo->blocks_per_group;
+	u64 dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+	u64 end = *blocks ? *blocks : dev_blocks;
+	u64 limit;
+	u32 old_end, old_count, count, rem, tail, added = 0;
+	struct zramfs_group *grp;
+	u32 g;
+	int err = 0;
+
+	if (sb->s_flags & MS_RDONLY)
+		return -EROFS;
+	if (end > dev_blocks)
+		return -EINVAL;
+	//block numbers are u32, and int for modules older than the feature words
+	limit = sbinfo->rev_level == ZRAMFS_REV_ORIG ? 0x7fffffffULL : 0xffffffffULL;
+	if (end > limit)
+		end = limit;
+	//descriptors that fit in the gdt, inode numbers that fit in an int
+	limit = sbinfo->first_group_block + (u64)fsi->group_max * bpg;
+	if (end > limit)
+		end = limit;
+	limit = sbinfo->first_group_block + (u64)(0x7fffffff / sbinfo->inodes_per_group) * bpg;
+	if (end > limit)
+		end = limit;
+
+	mutex_lock(&fsi->resize_lock);
+	old_end = sbinfo->block_num;
+	old_count = sbinfo->group_count;
+	if (end < old_end) {
+		err = -EINVAL;
+		goto out;
+	}
+	//a new short last group only if it has room for some data
+	count = div_u64_rem(end - sbinfo->first_group_block, bpg, &rem);
+	if (rem && (count < old_count || rem >= meta + ZRAMFS_MIN_GROUP_DATA))
+		count++;
+	else
+		end -= rem;
+	if (end == old_end)
+		goto out;
+
+	err = zramfs_alloc_groups(fsi, count);
+	if (err)
+		goto out;
+	//the thread would miss the new groups, it is started again at the end
+	zramfs_lazyinit_stop(sb);
+	for (g = old_count; g < count; g++) {
+		err = zramfs_add_group(sb, g, end);
+		if (err) {
+			printk(KERN_ERR "zramfs: resize, group:%u, err:%d\n", g, err);
+			goto restart;
+		}
+		added += zramfs_group(fsi, g)->free_blocks;
+	}
+	grp = zramfs_group(fsi, old_count - 1);
+	tail = min_t(u64, bpg, end - grp->begin) - grp->block_count;
+	//the blocks past the old end were set in the bitmap of the last group.
+	//clear them before the commit point, the old block_count keeps the
+	//allocators away from them until then
+	if (tail && !(grp->desc.flags & ZRAMFS_BG_BLOCK_UNINIT)) {
+		mutex_lock(&grp->lock);
+		err = set_dev_bit_range(sb->s_bdev, bitmap_offset(sb, grp->desc.block_bitmap),
+				grp->block_count, tail, UNSET);
+		mutex_unlock(&grp->lock);
+		if (err) {
+			printk(KERN_ERR "zramfs: resize, group:%u, tail not cleared, err:%d\n",
+					old_count - 1, err);
+			goto restart;
+		}
+	}
+	//the groups are set up before anyone can see them
+	smp_wmb();
+
+	mutex_lock(&fsi->orphan_lock);
+	sbinfo->block_num = end;
+	sbinfo->group_count = count;
+	sbinfo->inode_num = count * sbinfo->inodes_per_group;
+	sbinfo->data_num += added + tail;
+	if (count > old_count)
+		sbinfo->flags |= ZRAMFS_SB_UNINIT;
+	if (end > 0x7fffffffULL)
+		sbinfo->feature_incompat |= ZRAMFS_FEATURE_INCOMPAT_BLOCKS32;
+	err = zramfs_write_sb(sb);
+	mutex_unlock(&fsi->orphan_lock);
+	if (err) {
+		printk(KERN_ERR "zramfs: resize, super block not written, err:%d\n", err);
+		goto restart;
+	}
+
+	if (tail) {
+		mutex_lock(&grp->lock);
+		grp->block_count += tail;
+		grp->free_blocks += tail;
+		mutex_unlock(&grp->lock);
+	}
+	printk(KERN_NOTICE "zramfs: %s resized, blocks:%u, groups:%u, data blocks:%u\n",
+			sb->s_id, sbinfo->block_num, sbinfo->group_count, sbinfo->data_num);
+restart:
+	if (!fsi->mount_opts.nolazyinit)
+		zramfs_lazyinit_start(sb);
+out:
+	*blocks = sbinfo->block_num;
+	mutex_unlock(&fsi->resize_lock);
+	return err;
+}
+
+/*
+ * Orlov: directories under the root go to a lightly used group with at
+ * least average free space, others stay near their parent unless its
+ * group has too many directories or too little room. the counters are
+ * read without the group locks, they only steer the search.
+ */
+static u32 find_group_dir(struct super_block *sb, const struct inode *dir)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	u32 ngroups = sbinfo->group_count;
+	u32 parent = dir ? dir->i_ino / sbinfo->inodes_per_group : 0;
+	u64 free_inodes = 0, free_blocks = 0, dirs = 0;
+	u32 avefreei, avefreeb, max_dirs, min_inodes, min_blocks;
+	struct zramfs_group *grp;
+	int best = -1;
+	u32 start, g, i;
+
+	for (g = 0; g < ngroups; g++) {
+		free_inodes += zramfs_group(fsi, g)->free_inodes;
+		free_blocks += zramfs_group(fsi, g)->free_blocks;
+		dirs += zramfs_group(fsi, g)->desc.used_dirs;
+	}
+	avefreei = div_u64(free_inodes, ngroups);
+	avefreeb = div_u64(free_blocks, ngroups);
+
+	if (!dir || dir->i_ino == ROOT_INODE_NUM) {
+		get_random_bytes(&start, sizeof(start));
+		for (i = 0; i < ngroups; i++) {
+			g = (start + i) % ngroups;
+			grp = zramfs_group(fsi, g);
+			if (grp->free_inodes < avefreei || grp->free_blocks < avefreeb)
+				continue;
+			if (best < 0 || grp->desc.used_dirs < zramfs_group(fsi, best)->desc.used_dirs)
+				best = g;
+		}
+		if (best >= 0)
+			return best;
+	} else {
+		max_dirs = div_u64(dirs, ngroups) + sbinfo->inodes_per_group / 16;
+		min_inodes = avefreei > sbinfo->inodes_per_group / 4 ?
+			avefreei - sbinfo->inodes_per_group / 4 : 1;
+		min_blocks = avefreeb > sbinfo->blocks_per_group / 4 ?
+			avefreeb - sbinfo->blocks_per_group / 4 : 1;
+		for (i = 0; i < ngroups; i++) {
+			g = (parent + i) % ngroups;
+			grp = zramfs_group(fsi, g);
+			if (grp->desc.used_dirs < max_dirs && grp->free_inodes >= min_inodes &&
+					grp->free_blocks >= min_blocks)
+				return g;
+		}
+	}
+	//crowded everywhere, any group with average free inodes
+	for (i = 0; i < ngroups; i++) {
+		g = (parent + i) % ngroups;
+		if (zramfs_group(fsi, g)->free_inodes && zramfs_group(fsi, g)->free_inodes >= avefreei)
+			return g;
+	}
+	return parent;
+}
+
+/*
+ * files and the rest: the group of the directory, then a hashed probe
+ * so siblings of a full group don't all pile into the next one
+ */
+static u32 find_group_other(struct super_block *sb, const struct inode *dir)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	u32 ngroups = fsi->sbinfo.group_count;
+	u32 parent = dir ? dir->i_ino / fsi->sbinfo.inodes_per_group : 0;
+	struct zramfs_group *grp = zramfs_group(fsi, parent);
+	u32 g, i;
+
+	if (grp->free_inodes && grp->free_blocks)
+		return parent;
+	g = dir ? (parent + dir->i_ino) % ngroups : 0;
+	for (i = 1; i < ngroups; i <<= 1) {
+		g = (g + i) % ngroups;
+		grp = zramfs_group(fsi, g);
+		if (grp->free_inodes && grp->free_blocks)
+			return g;
+	}
+	return parent;
+}
+
+static u32 alloc_inode_in_group(struct super_block *sb, u32 group, int is_dir)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+	loff_t begin = bitmap_offset(sb, grp->desc.inode_bitmap);
+	unsigned int bit;
+	u32 ino = 0;
+
+	mutex_lock(&grp->lock);
+	if (!grp->free_inodes)
+		goto out;
+	if ((grp->desc.flags & ZRAMFS_BG_INODE_UNINIT) && zramfs_init_inode_bitmap(sb, group))
+		goto out;
+	if (!find_free_run(sb->s_bdev, begin, 0, sbinfo->inodes_per_group, 1, &bit))
+		goto out;
+	if (set_dev_bit_range(sb->s_bdev, begin, bit, 1, SET))
+		goto out;
+	grp->free_inodes--;
+	if (is_dir) {
+		grp->desc.used_dirs++;
+		zramfs_write_group_desc(sb, group, 0);
+	}
+	ino = group * sbinfo->inodes_per_group + bit;
+out:
+	mutex_unlock(&grp->lock);
+	return ino;
+}
+
+/**
+ * allocate an inode number for a new inode in dir, 0 when there is none
+ */
+u32 zramfs_new_inode_num(struct super_block *sb, const struct inode *dir, int mode)
+{
+	u32 ngroups = SBINFO(sb)->group_count;
+	u32 group, i;
+	u32 ino = 0;
+
+	if (S_ISDIR(mode))
+		group = find_group_dir(sb, dir);
+	else
+		group = find_group_other(sb, dir);
+	for (i = 0; i < ngroups && !ino; i++)
+		ino = alloc_inode_in_group(sb, (group + i) % ngroups, S_ISDIR(mode));
+ 	printk(KERN_NOTICE "*** zramfs_new_inode_num:%u, group:%u, mode:%o\n", ino, group, mode);
+	return ino;
+}
+
+void zramfs_free_inode_num(struct super_block *sb, u32 ino, int is_dir)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	u32 group = ino / sbinfo->inodes_per_group;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+
+	mutex_lock(&grp->lock);
+	if (set_dev_bit_range(sb->s_bdev, bitmap_offset(sb, grp->desc.inode_bitmap),
+				ino % sbinfo->inodes_per_group, 1, UNSET)) {
+		printk(KERN_ERR "zramfs_free_inode_num, io error, inode %u leaked\n", ino);
+		goto out;
+	}
+	grp->free_inodes++;
+	if (is_dir && grp->desc.used_dirs) {
+		grp->desc.used_dirs--;
+		zramfs_write_group_desc(sb, group, 0);
+	}
+out:
+	mutex_unlock(&grp->lock);
+}
+
+/*
+ * cut the run [*bit, *bit + n) of the group short at the first run a cpu
+ * pool reserved in it and return its length, or return 0 with *bit past
+ * the reserved run it starts in. the group lock is held.
+ */
+static unsigned int pool_clip(struct zramfs_group *grp, unsigned int *bit, unsigned int n)
+{
+	struct zramfs_pool *pool;
+	u32 first, last;
+
+	list_for_each_entry(pool, &grp->pools, list) {
+		first = pool->begin - grp->begin;
+		last = pool->end - grp->begin;
+		if (first <= *bit && *bit < last) {
+			*bit = last;
+			return 0;
+		}
+		if (*bit < first && first < *bit + n)
+			n = first - *bit;
+	}
+	return n;
+}
+
+/**
+ * find_free_run on the block bitmap of a group, leaving out the runs the
+ * cpu pools reserved. the group lock is held.
+ */
+unsigned int zramfs_find_free_run(struct super_block *sb, u32 group, unsigned int from,
+		unsigned int to, unsigned int max, unsigned int *bit)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+	loff_t begin = bitmap_offset(sb, grp->desc.block_bitmap);
+	unsigned int n;
+
+	while (from < to) {
+		n = find_free_run(sb->s_bdev, begin, from, to, max, bit);
+		if (!n)
+			return 0;
+		n = pool_clip(grp, bit, n);
+		if (n)
+			return n;
+		from = *bit;
+	}
+	return 0;
+}
+
+/*
+ * set the blocks the pool handed out since the last time in the bitmap.
+ * the pool is in grp, whose lock is held.
+ */
+static void pool_sync_locked(struct super_block *sb, struct zramfs_group *grp, struct zramfs_pool *pool)
+{
+	u32 from, to;
+
+	spin_lock(&pool->lock);
+	from = pool->synced;
+	to = pool->block;
+	pool->synced = to;
+	spin_unlock(&pool->lock);
+	if (to > from && set_dev_bit_range(sb->s_bdev, bitmap_offset(sb, grp->desc.block_bitmap),
+				from - grp->begin, to - from, SET))
+		printk(KERN_ERR "zramfs: pool sync, io error, blocks:%u-%u\n", from, to);
+}
+
+/*
+ * bring the bitmap of a group up to date with its pools before bits are
+ * cleared in it, the group lock is held
+ */
+static void pool_sync_group(struct super_block *sb, struct zramfs_group *grp)
+{
+	struct zramfs_pool *pool;
+
+	list_for_each_entry(pool, &grp->pools, list)
+		pool_sync_locked(sb, grp, pool);
+}
+
+/*
+ * the group of the run a pool holds, or -1 if it holds none. it may move
+ * on once the pool lock is dropped, check again under the group lock.
+ */
+static long pool_group(struct super_block *sb, struct zramfs_pool *pool, int dirty)
+{
+	long group = -1;
+
+	spin_lock(&pool->lock);
+	if (!list_empty(&pool->list) && (!dirty || pool->block > pool->synced))
+		group = group_of_block(SBINFO(sb), pool->begin);
+	spin_unlock(&pool->lock);
+	return group;
+}
+
+static int pool_in_group(struct super_block *sb, struct zramfs_pool *pool, u32 group)
+{
+	return !list_empty(&pool->list) && group_of_block(SBINFO(sb), pool->begin) == group;
+}
+
+/*
+ * end the run of a pool: what it handed out is set in the bitmap, the
+ * rest goes back to the group
+ */
+static void pool_release(struct super_block *sb, struct zramfs_pool *pool)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_group *grp;
+	long group = pool_group(sb, pool, 0);
+	u32 from, to, unused;
+
+	if (group < 0)
+		return;
+	grp = zramfs_group(fsi, group);
+	mutex_lock(&grp->lock);
+	if (pool_in_group(sb, pool, group)) {
+		spin_lock(&pool->lock);
+		from = pool->synced;
+		to = pool->block;
+		unused = pool->end - pool->block;
+		pool->block = pool->synced = pool->end;
+		list_del_init(&pool->list);
+		spin_unlock(&pool->lock);
+		if (to > from && set_dev_bit_range(sb->s_bdev, bitmap_offset(sb, grp->desc.block_bitmap),
+					from - grp->begin, to - from, SET))
+			printk(KERN_ERR "zramfs: pool release, io error, blocks:%u-%u\n", from, to);
+		grp->free_blocks += unused;
+	}
+	mutex_unlock(&grp->lock);
+}
+
+/*
+ * take up to ZRAMFS_POOL_BLOCKS free blocks in a row from the group, the
+ * first run from bit goal on, wrapping around. the first block is set in
+ * the bitmap and returned, the rest is reserved for the pool of this cpu
+ * in memory only, so a crash loses none of it.
+ */
+static u32 alloc_run_in_group(struct super_block *sb, u32 group, u32 goal)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+	loff_t begin = bitmap_offset(sb, grp->desc.block_bitmap);
+	struct zramfs_pool *pool;
+	unsigned int bit;
+	unsigned int n;
+	u32 block = 0;
+
+	mutex_lock(&grp->lock);
+	if (!grp->free_blocks)
+		goto out;
+	if ((grp->desc.flags & ZRAMFS_BG_BLOCK_UNINIT) && zramfs_init_block_bitmap(sb, group))
+		goto out;
+	n = zramfs_find_free_run(sb, group, goal, grp->block_count, ZRAMFS_POOL_BLOCKS, &bit);
+	if (!n && goal)
+		n = zramfs_find_free_run(sb, group, 0, goal, ZRAMFS_POOL_BLOCKS, &bit);
+	if (!n || set_dev_bit_range(sb->s_bdev, begin, bit, 1, SET))
+		goto out;
+	grp->free_blocks -= n;
+	block = grp->begin + bit;
+	if (n == 1)
+		goto out;
+	//the run is listed under the group lock, nobody else may find it free
+	pool = per_cpu_ptr(fsi->pools, get_cpu());
+	spin_lock(&pool->lock);
+	if (list_empty(&pool->list)) {
+		pool->begin = pool->block = pool->synced = block + 1;
+		pool->end = block + n;
+		list_add(&pool->list, &grp->pools);
+	} else {
+		//we moved to a cpu whose pool got a run meanwhile
+		grp->free_blocks += n - 1;
+	}
+	spin_unlock(&pool->lock);
+	put_cpu();
+out:
+	mutex_unlock(&grp->lock);
+	return block;
+}
+
+/*
+ * next block of this cpu's pool if the pool is in group, else 0. only
+ * the pool is touched, the bitmap follows in zramfs_sync_pools.
+ */
+static u32 pool_take(struct super_block *sb, u32 group)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_pool *pool = per_cpu_ptr(fsi->pools, get_cpu());
+	u32 block = 0;
+
+	spin_lock(&pool->lock);
+	if (pool->block < pool->end && group_of_block(&fsi->sbinfo, pool->block) == group)
+		block = pool->block++;
+	spin_unlock(&pool->lock);
+	put_cpu();
+	return block;
+}
+
+/**
+ * set the blocks every cpu's pool handed out in the bitmap. an inode is
+ * written only after the blocks it points to are marked used.
+ */
+void zramfs_sync_pools(struct super_block *sb)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_pool *pool;
+	struct zramfs_group *grp;
+	long group;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(fsi->pools, cpu);
+		group = pool_group(sb, pool, 1);
+		if (group < 0)
+			continue;
+		grp = zramfs_group(fsi, group);
+		mutex_lock(&grp->lock);
+		if (pool_in_group(sb, pool, group))
+			pool_sync_locked(sb, grp, pool);
+		mutex_unlock(&grp->lock);
+	}
+}
+
+/**
+ * end the runs of every cpu's pool
+ */
+void zramfs_drain_pools(struct super_block *sb)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		pool_release(sb, per_cpu_ptr(fsi->pools, cpu));
+}
+
+/**
+ * allocate a data block for file block iblock of inode, from this cpu's
+ * pool when it is in the right group. a new pool is taken right behind
+ * the closest block before iblock if possible, else in the group of the
+ * inode. returns 0 when there is no free block, block 0 is the super
+ * block and never data.
+ */
+u32 zramfs_get_data_block(struct inode *inode, sector_t iblock)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	struct gza_inode *ginode = inode->i_private;
+	u32 ngroups = sbinfo->group_count;
+	u32 group = inode->i_ino / sbinfo->inodes_per_group;
+	u32 goal = 0;
+	struct zramfs_pool *pool;
+	int retry = 1;
+	u32 block;
+	u32 i;
+
+	for (i = iblock; i-- > 0;) {
+		if (!ginode->data[i])
+			continue;
+		if (ginode->data[i] + 1 < sbinfo->block_num) {
+			group = group_of_block(sbinfo, ginode->data[i] + 1);
+			goal = ginode->data[i] + 1 - zramfs_group(fsi, group)->begin;
+		}
+		break;
+	}
+	block = pool_take(sb, group);
+	if (block)
+		return block;
+	//the pool is in another group or used up, its run ends
+	pool = per_cpu_ptr(fsi->pools, get_cpu());
+	put_cpu();
+	pool_release(sb, pool);
+again:
+	for (i = 0; i < ngroups; i++) {
+		block = alloc_run_in_group(sb, (group + i) % ngroups, i ? 0 : goal);
+		if (block)
+			return block;
+	}
+	//the other cpus' pools and the workers may still hold free blocks
+	if (retry--) {
+		zramfs_drain_pools(sb);
+		if (fsi->mount_opts.async_free || fsi->mount_opts.discard) {
+			flush_work(&fsi->free_work);
+			flush_work(&fsi->discard_work);
+		}
+		goto again;
+	}
+	return 0;
+}
+
+/**
+ * clear a run of blocks in their bitmap. a run never crosses groups, the
+ * head of every group is its metadata, which is never freed.
+ */
+void zramfs_clear_block_run(struct super_block *sb, unsigned int block, unsigned int count)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_group *grp = zramfs_group(fsi, group_of_block(&fsi->sbinfo, block));
+
+	mutex_lock(&grp->lock);
+	pool_sync_group(sb, grp);
+	if (set_dev_bit_range(sb->s_bdev, bitmap_offset(sb, grp->desc.block_bitmap),
+				block - grp->begin, count, UNSET))
+		printk(KERN_ERR "zramfs_clear_block_run, io error, block:%u, count:%u\n", block, count);
+	else
+		grp->free_blocks += count;
+	mutex_unlock(&grp->lock);
+}
+
+static int cmp_block(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * give data blocks got by zramfs_get_data_block back to their groups.
+ * blocks is sorted in place so each group is locked once.
+ */
+void zramfs_free_data_blocks(struct super_block *sb, unsigned int *blocks, int count)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	struct zramfs_group *grp;
+	u32 meta = zramfs_group_meta_blocks(sbinfo);
+	int first, n;
+
+	if (!count)
+		return;
+	sort(blocks, count, sizeof(*blocks), cmp_block, NULL);
+	for (first = 0; first < count && blocks[first] < sbinfo->first_group_block; first++)
+		printk(KERN_ERR "zramfs_free_data_blocks, bad block %u\n", blocks[first]);
+	for (n = count; n > first && blocks[n - 1] >= sbinfo->block_num; n--)
+		printk(KERN_ERR "zramfs_free_data_blocks, bad block %u\n", blocks[n - 1]);
+	blocks += first;
+	count = n - first;
+	if (fsi->mount_opts.discard) {
+		zramfs_queue_discard(sb, blocks, count);
+		return;
+	}
+	while (count) {
+		grp = zramfs_group(fsi, group_of_block(sbinfo, blocks[0]));
+		for (n = 0; n < count && blocks[n] < grp->begin + grp->block_count; n++)
+			blocks[n] -= grp->begin;
+		mutex_lock(&grp->lock);
+		//a block handed out by a pool may not be set yet
+		pool_sync_group(sb, grp);
+		if (blocks[0] < meta || clear_dev_bits(sb->s_bdev,
+					bitmap_offset(sb, grp->desc.block_bitmap), blocks, n))
+			printk(KERN_ERR "zramfs_free_data_blocks, %d blocks leaked\n", n);
+		else
+			grp->free_blocks += n;
+		mutex_unlock(&grp->lock);
+		blocks += n;
+		count -= n;
+	}
+}
+
+/**
+ * write out the block bitmaps of the groups the blocks are in, 0 entries
+ * are skipped
+ */
+void zramfs_sync_block_bitmaps(struct super_block *sb, unsigned int *blocks, int count)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	struct buffer_head *bh;
+	u32 group, last = 0;
+	int seen = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (blocks[i] < sbinfo->first_group_block || blocks[i] >= sbinfo->block_num)
+			continue;
+		group = group_of_block(sbinfo, blocks[i]);
+		if (seen && group == last)
+			continue;
+		seen = 1;
+		last = group;
+		bh = __find_get_block(sb->s_bdev, zramfs_group(fsi, group)->desc.block_bitmap,
+				sb->s_blocksize);
+		if (!bh)
+			continue;
+		if (buffer_dirty(bh))
+			sync_dirty_buffer(bh);
+		brelse(bh);
+	}
+}
+
+void zramfs_free_data_block(struct super_block *sb, unsigned int block)
+{
+	zramfs_free_data_blocks(sb, &block, 1);
+}
@@ -6,14 +6,14 @@
 /**
  * clear bdev block content
  */
-int clear_bdev_block_content(struct block_device *bdev, int dev_block, int blocksize)
+int clear_bdev_block_content(struct block_device *bdev, sector_t dev_block, int blocksize)
 {
 	struct buffer_head *bh;
 	void * cur;
 	long * lc;
 	char * cc;
 	int last;
-	printk(KERN_NOTICE"clear_bdev_block_content, dev_block:%d, size:%d", dev_block, blocksize);
+	printk(KERN_NOTICE"clear_bdev_block_content, dev_block:%llu, size:%d", (unsigned long long)dev_block, blocksize);
 	bh = __bread(bdev, dev_block, blocksize);
 	if (PageHighMem(bh->b_page)) {
 		cur = kmap_atomic(bh->b_page, KM_USER0);
@@ -41,22 +41,22 @@ int clear_bdev_block_content(struct block_device *bdev, int dev_block, int block
 {
 	int block_size = bdev->bd_block_size;
 	int block_bits = bdev->bd_inode->i_blkbits;
-	int begin_block = offset >> block_bits;
-	int end_block = (offset + size) >> block_bits;
+	sector_t begin_block = offset >> block_bits;
+	sector_t end_block = (offset + size) >> block_bits;
 	int off = offset & ((1<<block_bits) - 1);
 	struct buffer_head *bh; 
 	char *cur = NULL;
 	int count;
 	int left = size;
-	int i = begin_block - 1;
-	while (++i <= end_block) {
+	sector_t i;
+	for (i = begin_block; left > 0 && i <= end_block; i++) {
 		bh = __bread(bdev, i, block_size);
-		printk(KERN_NOTICE "zramfs, get_dev_content, bdev:%p, block:%d, block_size:%d, bh:%p, buff:%p, size:%d", bdev, i, block_size,bh, buff, size);
+		printk(KERN_NOTICE "zramfs, get_dev_content, bdev:%p, block:%llu, block_size:%d, bh:%p, buff:%p, size:%d", bdev, (unsigned long long)i, block_size,bh, buff, size);
 		count = block_size;
-		if (i == end_block)
-			count = left;
 		if (i == begin_block) 
 			count -= off;
+		if (count > left)
+			count = left;
 		if (PageHighMem(bh->b_page)) {
 			cur = kmap_atomic(bh->b_page, KM_USER0);
 			cur +=  (int)bh->b_data;
@@ -82,21 +82,21 @@ int clear_bdev_block_content(struct block_device *bdev, int dev_block, int block
 {
 	int block_size = bdev->bd_block_size;
 	int block_bits = bdev->bd_inode->i_blkbits;
-	int begin_block = offset >> block_bits;
-	int end_block = (offset + size) >> block_bits;
+	sector_t begin_block = offset >> block_bits;
+	sector_t end_block = (offset + size) >> block_bits;
 	int off = offset & ((1<<block_bits) - 1);
 	struct buffer_head *bh; 
 	char *cur = NULL;
 	int count;
 	int left = size;
-	int i = begin_block - 1;
-	while (++i <= end_block) {
+	sector_t i;
+	for (i = begin_block; left > 0 && i <= end_block; i++) {
 		bh = __bread(bdev, i, block_size);
 		count = block_size;
-		if (i == end_block)
-			count = left;
 		if (i == begin_block)
 			count -= off;
+		if (count > left)
+			count = left;
 		if (PageHighMem(bh->b_page)) {
 			cur = kmap_atomic(bh->b_page, KM_USER0);
 			cur +=  (int)bh->b_data;
@@ -121,7 +121,7 @@ int clear_bdev_block_content(struct block_device *bdev, int dev_block, int block
 {
 	int block_size = bdev->bd_block_size;
 	int block_bits = bdev->bd_inode->i_blkbits;
-	int begin_block = offset >> block_bits;
+	sector_t begin_block = offset >> block_bits;
 	int off = offset & ((1<<block_bits) - 1);
 	struct buffer_head *bh; 
 	char *cur = NULL;
@@ -150,18 +150,18 @@ int find_valid_bit_num(struct block_device *bdev, loff_t begin, loff_t end)
 {
 	int block_size = bdev->bd_block_size;
 	int block_bits = bdev->bd_inode->i_blkbits;
-	int begin_block = begin >> block_bits;
-	int end_block = end >> block_bits;
+	sector_t begin_block = begin >> block_bits;
+	sector_t end_block = end >> block_bits;
 	int off = begin & ((1<<block_bits) - 1);
 	int left = end & ((1<<block_bits) - 1);
 	struct buffer_head *bh; 
 	char *cur = NULL;
 	int count;
-	int i = begin_block - 1;
+	sector_t i;
 	int byte = 0;
 	int bit = 0;
 	int index = 0;
-	while (++i <= end_block) {
+	for (i = begin_block; i <= end_block; i++) {
 		bh = __bread(bdev, i, block_size);
 		count = block_size;
 		if (i == end_block)
@@ -205,3 +205,225 @@ end:
 }
 
 
+
+/**
+ * clear bits (sorted ascending) of the bitmap that starts at byte begin.
+ * bits in the same device block are cleared under a single __bread.
+ */
+int clear_dev_bits(struct block_device *bdev, loff_t begin, unsigned int *bits, int count)
+{
+	int block_size = bdev->bd_block_size;
+	int block_bits = bdev->bd_inode->i_blkbits;
+	struct buffer_head *bh = NULL;
+	sector_t cur_block = 0;
+	sector_t block;
+	loff_t offset;
+	char *cur = NULL;
+	int i;
+	for (i = 0; i < count; i++) {
+		offset = begin + (bits[i] >> 3);
+		block = offset >> block_bits;
+		if (!bh || block != cur_block) {
+			if (bh) {
+				if (PageHighMem(bh->b_page))
+					kunmap_atomic(cur, KM_USER0);
+				mark_buffer_dirty(bh);
+				put_bh(bh);
+			}
+			bh = __bread(bdev, block, block_size);
+			if (!bh)
+				return -EIO;
+			cur_block = block;
+			if (PageHighMem(bh->b_page)) {
+				cur = kmap_atomic(bh->b_page, KM_USER0);
+				cur += bh_offset(bh);
+			} else {
+				cur = bh->b_data;
+			}
+		}
+		cur[offset & (block_size - 1)] &= ~(1 << (bits[i] & 0x07));
+	}
+	if (bh) {
+		if (PageHighMem(bh->b_page))
+			kunmap_atomic(cur, KM_USER0);
+		mark_buffer_dirty(bh);
+		put_bh(bh);
+	}
+	return 0;
+}
+
+/**
+ * find the first run of clear bits in [from, to) of the bitmap that starts
+ * at byte begin, at most max long. returns its length, 0 if there is none,
+ * and its first bit in *run.
+ */
+unsigned int find_free_run(struct block_device *bdev, loff_t begin, unsigned int from, unsigned int to, unsigned int max, unsigned int *run)
+{
+	int block_size = bdev->bd_block_size;
+	int block_bits = bdev->bd_inode->i_blkbits;
+	struct buffer_head *bh = NULL;
+	sector_t cur_block = 0;
+	sector_t block;
+	loff_t offset;
+	unsigned char *cur = NULL;
+	unsigned char byte;
+	unsigned int bit;
+	unsigned int count = 0;
+	for (bit = from; bit < to; bit++) {
+		offset = begin + (bit >> 3);
+		block = offset >> block_bits;
+		if (!bh || block != cur_block) {
+			if (bh) {
+				if (PageHighMem(bh->b_page))
+					kunmap_atomic(cur, KM_USER0);
+				put_bh(bh);
+			}
+			bh = __bread(bdev, block, block_size);
+			if (!bh)
+				break;
+			cur_block = block;
+			if (PageHighMem(bh->b_page)) {
+				cur = kmap_atomic(bh->b_page, KM_USER0);
+				cur += bh_offset(bh);
+			} else {
+				cur = bh->b_data;
+			}
+		}
+		byte = cur[offset & (block_size - 1)];
+		//skip full bytes while no run is open
+		if (!count && byte == 0xff && !(bit & 0x07)) {
+			bit += 7;
+			continue;
+		}
+		if (byte & (1 << (bit & 0x07))) {
+			if (count)
+				break;
+			continue;
+		}
+		if (!count)
+			*run = bit;
+		if (++count >= max)
+			break;
+	}
+	if (bh) {
+		if (PageHighMem(bh->b_page))
+			kunmap_atomic(cur, KM_USER0);
+		put_bh(bh);
+	}
+	return count;
+}
+
+/**
+ * number of set bits in [0, nbits) of the bitmap at byte begin
+ */
+unsigned int count_dev_bits(struct block_device *bdev, loff_t begin, unsigned int nbits)
+{
+	int block_size = bdev->bd_block_size;
+	int block_bits = bdev->bd_inode->i_blkbits;
+	struct buffer_head *bh;
+	unsigned char *cur;
+	loff_t offset = begin;
+	unsigned int left = nbits;
+	unsigned int count = 0;
+	int off, len, i;
+	while (left) {
+		bh = __bread(bdev, offset >> block_bits, block_size);
+		if (!bh)
+			break;
+		if (PageHighMem(bh->b_page)) {
+			cur = kmap_atomic(bh->b_page, KM_USER0);
+			cur += bh_offset(bh);
+		} else {
+			cur = bh->b_data;
+		}
+		off = offset & (block_size - 1);
+		len = block_size - off;
+		for (i = off; i < off + len && left; i++) {
+			if (left >= 8) {
+				count += hweight8(cur[i]);
+				left -= 8;
+			} else {
+				count += hweight8(cur[i] & ((1 << left) - 1));
+				left = 0;
+			}
+		}
+		if (PageHighMem(bh->b_page))
+			kunmap_atomic(cur, KM_USER0);
+		put_bh(bh);
+		offset += len;
+	}
+	return count;
+}
+
+/**
+ * set or clear count bits from bit first of the bitmap at byte begin
+ */
+int set_dev_bit_range(struct block_device *bdev, loff_t begin, unsigned int first, unsigned int count, enum SET_FLAG flag)
+{
+	int block_size = bdev->bd_block_size;
+	int block_bits = bdev->bd_inode->i_blkbits;
+	struct buffer_head *bh = NULL;
+	sector_t cur_block = 0;
+	sector_t block;
+	loff_t offset;
+	char *cur = NULL;
+	unsigned int bit;
+	for (bit = first; bit < first + count; bit++) {
+		offset = begin + (bit >> 3);
+		block = offset >> block_bits;
+		if (!bh || block != cur_block) {
+			if (bh) {
+				if (PageHighMem(bh->b_page))
+					kunmap_atomic(cur, KM_USER0);
+				mark_buffer_dirty(bh);
+				put_bh(bh);
+			}
+			bh = __bread(bdev, block, block_size);
+			if (!bh)
+				return -EIO;
+			cur_block = block;
+			if (PageHighMem(bh->b_page)) {
+				cur = kmap_atomic(bh->b_page, KM_USER0);
+				cur += bh_offset(bh);
+			} else {
+				cur = bh->b_data;
+			}
+		}
+		if (flag == SET)
+			cur[offset & (block_size - 1)] |= (1 << (bit & 0x07));
+		else
+			cur[offset & (block_size - 1)] &= ~(1 << (bit & 0x07));
+	}
+	if (bh) {
+		if (PageHighMem(bh->b_page))
+			kunmap_atomic(cur, KM_USER0);
+		mark_buffer_dirty(bh);
+		put_bh(bh);
+	}
+	return 0;
+}
+
+/**
+ * zero [offset, offset + len) of the device, device block aligned. the
+ * blocks are not read first, they are only dirtied.
+ */
+int zero_dev_range(struct block_device *bdev, loff_t offset, loff_t len)
+{
+	int block_size = bdev->bd_block_size;
+	int block_bits = bdev->bd_inode->i_blkbits;
+	sector_t block = offset >> block_bits;
+	sector_t end = (offset + len) >> block_bits;
+	struct buffer_head *bh;
+	for (; block < end; block++) {
+		bh = __getblk(bdev, block, block_size);
+		if (!bh)
+			return -ENOMEM;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, block_size);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		put_bh(bh);
+	}
+	return 0;
+}
@@ -0,0 +1,661 @@
+/* dir.c: in-memory name index of directories
+ *
+ * The first lookup or readdir of a directory reads all its entries into
+ * a small hash table of name -> (inode, position). Later lookups, hits
+ * and misses alike, are answered from it without reading a block, and
+ * unlink and rename go straight to the entry. Adding, clearing and
+ * changing an entry keep the table up to date; when that fails the table
+ * is dropped and built again later. A shrinker frees the tables of the
+ * directories not used lately.
+ *
+ * The same scan fills a bloom filter of the names, which stays when the
+ * shrinker takes the table. Names are only ever added to it, so a name it
+ * doesn't have is not in the directory and the miss costs no block read.
+ *
+ * New directories start inline: their entries are packed records in
+ * data[] of the inode, never removed but emptied, so record n keeps
+ * readdir position 2 + n. When one doesn't fit any more, record n moves
+ * to slot n of freshly allocated blocks and the positions stay valid.
+ *
+ * This file is released under the GPL.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/mm.h>
+#include "internal.h"
+
+#define ZRAMFS_INDEX_BITS 6
+
+struct zramfs_index_entry {
+	struct hlist_node node;
+	u32 hash;
+	u32 ino;
+	u32 pos;		/* byte offset of the entry in the directory */
+	int len;
+	char name[0];
+};
+
+struct zramfs_dir_index {
+	struct list_head lru;	/* on zramfs_index_lru */
+	struct zramfs_inode_info *info;
+	int count;
+	int referenced;		/* looked up since the shrinker last passed */
+	struct hlist_head hash[1 << ZRAMFS_INDEX_BITS];
+};
+
+/*
+ * lock order: zramfs_index_lru_lock, then index_lock of a directory.
+ * an index is only installed or taken away with both held.
+ */
+static LIST_HEAD(zramfs_index_lru);
+static DEFINE_SPINLOCK(zramfs_index_lru_lock);
+static atomic_t zramfs_index_entries = ATOMIC_INIT(0);
+
+/**
+ * hash of a name as kept in d_hash: 32 bit FNV-1a, never 0. it is on disk,
+ * so not the dcache hash, which differs between kernels.
+ */
+u32 zramfs_name_hash(const char *name, int len)
+{
+	u32 hash = 2166136261u;
+
+	while (len-- > 0) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619;
+	}
+	return hash ? hash : 1;
+}
+
+/* three bits of the filter from nine bit slices of the name hash */
+static void bloom_add(unsigned long *bloom, u32 hash)
+{
+	__set_bit(hash % ZRAMFS_BLOOM_BITS, bloom);
+	__set_bit((hash >> 9) % ZRAMFS_BLOOM_BITS, bloom);
+	__set_bit((hash >> 18) % ZRAMFS_BLOOM_BITS, bloom);
+}
+
+static int bloom_test(const unsigned long *bloom, u32 hash)
+{
+	return test_bit(hash % ZRAMFS_BLOOM_BITS, bloom) &&
+		test_bit((hash >> 9) % ZRAMFS_BLOOM_BITS, bloom) &&
+		test_bit((hash >> 18) % ZRAMFS_BLOOM_BITS, bloom);
+}
+
+static struct hlist_head *index_bucket(struct zramfs_dir_index *idx, u32 hash)
+{
+	return &idx->hash[hash_32(hash, ZRAMFS_INDEX_BITS)];
+}
+
+static struct zramfs_index_entry *index_find(struct zramfs_dir_index *idx,
+		const char *name, int len, u32 hash)
+{
+	struct zramfs_index_entry *e;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(e, n, index_bucket(idx, hash), node) {
+		if (e->hash == hash && e->len == len && !memcmp(e->name, name, len))
+			return e;
+	}
+	return NULL;
+}
+
+static struct zramfs_index_entry *index_entry_alloc(const char *name, int len, u32 hash,
+		u32 ino, u32 pos)
+{
+	struct zramfs_index_entry *e = kmalloc(sizeof(*e) + len, GFP_NOFS);
+
+	if (!e)
+		return NULL;
+	e->hash = hash;
+	e->ino = ino;
+	e->pos = pos;
+	e->len = len;
+	memcpy(e->name, name, len);
+	return e;
+}
+
+static void index_insert(struct zramfs_dir_index *idx, struct zramfs_index_entry *e)
+{
+	hlist_add_head(&e->node, index_bucket(idx, e->hash));
+	idx->count++;
+	atomic_inc(&zramfs_index_entries);
+}
+
+static void index_free(struct zramfs_dir_index *idx)
+{
+	struct zramfs_index_entry *e;
+	struct hlist_node *n, *tmp;
+	int i;
+
+	for (i = 0; i < (1 << ZRAMFS_INDEX_BITS); i++) {
+		hlist_for_each_entry_safe(e, n, tmp, &idx->hash[i], node)
+			kfree(e);
+	}
+	atomic_sub(idx->count, &zramfs_index_entries);
+	kfree(idx);
+}
+
+/**
+ * read the block holding byte pos of directory dir, *offset is where pos
+ * is in it
+ */
+struct buffer_head *zramfs_dir_bread(struct inode *dir, u32 pos, int *offset)
+{
+	struct gza_inode *ginode = dir->i_private;
+	struct block_device *bdev = dir->i_sb->s_bdev;
+	int blk_bits = blksize_bits(bdev->bd_block_size);
+	int shift = dir->i_blkbits - blk_bits;
+	u32 block = pos >> dir->i_blkbits;
+	sector_t dev_block;
+
+	if (zramfs_inline(dir) || block >= MAX_FILE_BLOCK_NUM || !ginode->data[block])
+		return NULL;
+	dev_block = ((sector_t)ginode->data[block] << shift) +
+		((pos & ((1 << dir->i_blkbits) - 1)) >> blk_bits);
+	*offset = pos & (bdev->bd_block_size - 1);
+	return __bread(bdev, dev_block, bdev->bd_block_size);
+}
+
+/**
+ * start reading the blocks of dir from byte pos on, before a scan waits on
+ * them one by one. blocks already in the cache are skipped.
+ */
+void zramfs_dir_readahead(struct inode *dir, u32 pos)
+{
+	struct gza_inode *ginode = dir->i_private;
+	struct block_device *bdev = dir->i_sb->s_bdev;
+	int blk_bits = blksize_bits(bdev->bd_block_size);
+	int shift = dir->i_blkbits - blk_bits;
+	u32 block = pos >> dir->i_blkbits;
+	sector_t dev_block;
+	int i;
+
+	if (zramfs_inline(dir))
+		return;
+	for (; block < MAX_FILE_BLOCK_NUM && ginode->data[block]; block++) {
+		dev_block = (sector_t)ginode->data[block] << shift;
+		for (i = 0; i < (1 << shift); i++)
+			__breadahead(bdev, dev_block + i, bdev->bd_block_size);
+	}
+}
+
+/**
+ * build the index of dir if it has none, dir_sem held. returns 0 when
+ * there is an index afterwards.
+ */
+int zramfs_index_build(struct inode *dir)
+{
+	struct zramfs_inode_info *info = ZRAMFS_I(dir);
+	struct block_device *bdev = dir->i_sb->s_bdev;
+	int blksize = bdev->bd_block_size;
+	struct zramfs_dir_index *idx;
+	struct zramfs_index_entry *e;
+	struct directory *dty;
+	struct buffer_head *bh;
+	unsigned long bloom[ZRAMFS_BLOOM_BITS / BITS_PER_LONG];
+	unsigned long gen;
+	char *cur;
+	u32 pos, end;
+	int offset, err = 0;
+	int count;
+	int i;
+
+	if (info->index)
+		return 0;
+	//nothing to gain over the records in the inode
+	if (zramfs_inline(dir))
+		return -EOPNOTSUPP;
+	spin_lock(&info->index_lock);
+	gen = info->dir_gen;
+	spin_unlock(&info->index_lock);
+
+	idx = kmalloc(sizeof(*idx), GFP_NOFS);
+	if (!idx)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&idx->lru);
+	idx->info = info;
+	idx->count = 0;
+	idx->referenced = 0;
+	for (i = 0; i < (1 << ZRAMFS_INDEX_BITS); i++)
+		INIT_HLIST_HEAD(&idx->hash[i]);
+	memset(bloom, 0, sizeof(bloom));
+
+	//directories have no holes, the first missing block ends it
+	zramfs_dir_readahead(dir, 0);
+	end = MAX_FILE_BLOCK_NUM << dir->i_blkbits;
+	for (pos = 0; pos < end && !err; pos += blksize) {
+		bh = zramfs_dir_bread(dir, pos, &offset);
+		if (!bh)
+			break;
+		cur = kmap(bh->b_page) + bh_offset(bh);
+		for (offset = 0; offset < blksize; offset += DIRECTORY_SIZE) {
+			dty = (struct directory *)(cur + offset);
+			if (!dty->d_status)
+				continue;
+			if (dty->d_len <= 0 || dty->d_len > MAX_DIR_NAME) {
+				err = -EIO;
+				break;
+			}
+			e = index_entry_alloc(dty->d_name, dty->d_len,
+					dty->d_hash ? dty->d_hash : zramfs_name_hash(dty->d_name, dty->d_len),
+					dty->d_num, pos + offset);
+			if (!e) {
+				err = -ENOMEM;
+				break;
+			}
+			index_insert(idx, e);
+			bloom_add(bloom, e->hash);
+		}
+		kunmap(bh->b_page);
+		put_bh(bh);
+	}
+	if (err) {
+		index_free(idx);
+		return err;
+	}
+
+	//an entry changed while we read, what we have may miss it
+	spin_lock(&zramfs_index_lru_lock);
+	spin_lock(&info->index_lock);
+	if (!info->index && info->dir_gen == gen) {
+		memcpy(info->bloom, bloom, sizeof(bloom));
+		info->bloom_valid = 1;
+		info->index = idx;
+		list_add_tail(&idx->lru, &zramfs_index_lru);
+		count = idx->count;
+		idx = NULL;
+	} else {
+		//someone else built one meanwhile, or the directory changed
+		err = info->index ? 0 : -EAGAIN;
+	}
+	spin_unlock(&info->index_lock);
+	spin_unlock(&zramfs_index_lru_lock);
+	if (idx) {
+		index_free(idx);
+		return err;
+	}
+	//the shrinker may free the index from here on
+	printk(KERN_NOTICE "zramfs_index_build, dir:%ld, entries:%d\n", dir->i_ino, count);
+	return 0;
+}
+
+/**
+ * drop the index of a directory
+ */
+void zramfs_index_drop(struct zramfs_inode_info *info)
+{
+	struct zramfs_dir_index *idx;
+
+	spin_lock(&zramfs_index_lru_lock);
+	spin_lock(&info->index_lock);
+	idx = info->index;
+	info->index = NULL;
+	info->dir_gen++;
+	if (idx)
+		list_del_init(&idx->lru);
+	spin_unlock(&info->index_lock);
+	spin_unlock(&zramfs_index_lru_lock);
+	if (idx)
+		index_free(idx);
+}
+
+/**
+ * look name up in the index of dir: 1 and its inode and position if it is
+ * there, 0 if it is not, -ENODATA if dir has no index and the filter
+ * can't tell
+ */
+int zramfs_index_lookup(struct inode *dir, const char *name, int len, u32 *ino, u32 *pos)
+{
+	struct zramfs_inode_info *info = ZRAMFS_I(dir);
+	u32 hash = zramfs_name_hash(name, len);
+	struct zramfs_index_entry *e;
+	int ret = -ENODATA;
+
+	spin_lock(&info->index_lock);
+	if (info->index) {
+		info->index->referenced = 1;
+		e = index_find(info->index, name, len, hash);
+		ret = 0;
+		if (e) {
+			*ino = e->ino;
+			if (pos)
+				*pos = e->pos;
+			ret = 1;
+		}
+	} else if (info->bloom_valid && !bloom_test(info->bloom, hash)) {
+		ret = 0;
+	}
+	spin_unlock(&info->index_lock);
+	return ret;
+}
+
+/**
+ * an entry was written at byte pos of dir
+ */
+void zramfs_index_add(struct inode *dir, const char *name, int len, u32 ino, u32 pos)
+{
+	struct zramfs_inode_info *info = ZRAMFS_I(dir);
+	u32 hash = zramfs_name_hash(name, len);
+	struct zramfs_index_entry *e = NULL;
+	int lost = 0;
+
+	if (info->index)
+		e = index_entry_alloc(name, len, hash, ino, pos);
+	spin_lock(&info->index_lock);
+	info->dir_gen++;
+	if (info->bloom_valid)
+		bloom_add(info->bloom, hash);
+	if (info->index) {
+		if (e)
+			index_insert(info->index, e);
+		else
+			lost = 1;
+		e = NULL;
+	}
+	spin_unlock(&info->index_lock);
+	kfree(e);
+	//a missing name would look like a miss, better no index at all
+	if (lost)
+		zramfs_index_drop(info);
+}
+
+/**
+ * the entry of name in dir now points at ino, or is gone if ino is 0
+ */
+void zramfs_index_update(struct inode *dir, const char *name, int len, u32 ino)
+{
+	struct zramfs_inode_info *info = ZRAMFS_I(dir);
+	u32 hash = zramfs_name_hash(name, len);
+	struct zramfs_index_entry *e = NULL;
+
+	spin_lock(&info->index_lock);
+	info->dir_gen++;
+	if (info->index)
+		e = index_find(info->index, name, len, hash);
+	if (e && ino) {
+		e->ino = ino;
+		e = NULL;
+	} else if (e) {
+		hlist_del(&e->node);
+		info->index->count--;
+		atomic_dec(&zramfs_index_entries);
+	}
+	spin_unlock(&info->index_lock);
+	kfree(e);
+}
+
+struct zramfs_inline_dirent {
+	u32 ino;		/* 0: emptied, the record keeps its place */
+	u8 len;			/* 0: no more records */
+	char name[0];
+} __attribute__ ((packed));
+
+#define INLINE_DIRENT_LEN(len) (sizeof(struct zramfs_inline_dirent) + (len))
+
+/*
+ * next record of an inline directory from byte *off on, NULL at the end
+ */
+static struct zramfs_inline_dirent *inline_next(struct inode *dir, int *off)
+{
+	char *area = (char *)((struct gza_inode *)dir->i_private)->data;
+	struct zramfs_inline_dirent *de;
+
+	if (*off + sizeof(*de) > ZRAMFS_INLINE_SIZE)
+		return NULL;
+	de = (struct zramfs_inline_dirent *)(area + *off);
+	if (!de->len)
+		return NULL;
+	*off += INLINE_DIRENT_LEN(de->len);
+	return de;
+}
+
+/**
+ * record number of name in an inline directory, dir_sem held
+ */
+int zramfs_inline_dir_find(struct inode *dir, const char *name, int len, u32 *ino)
+{
+	struct zramfs_inline_dirent *de;
+	int off = 0;
+	int n;
+
+	for (n = 0; (de = inline_next(dir, &off)); n++) {
+		if (de->ino && de->len == len && !memcmp(de->name, name, len)) {
+			*ino = de->ino;
+			return n;
+		}
+	}
+	return -ENOENT;
+}
+
+/**
+ * add a record to an inline directory, dir_sem held exclusive. the first
+ * emptied record is reused, -ENOSPC if there is no room.
+ */
+int zramfs_inline_dir_add(struct inode *dir, const char *name, int len, u32 ino)
+{
+	char *area = (char *)((struct gza_inode *)dir->i_private)->data;
+	struct zramfs_inline_dirent *de, *hole = NULL;
+	int need = INLINE_DIRENT_LEN(len);
+	int off = 0, at = 0, old = 0;
+	int end;
+
+	while ((de = inline_next(dir, &off))) {
+		if (!de->ino && !hole) {
+			hole = de;
+			at = (char *)de - area;
+			old = INLINE_DIRENT_LEN(de->len);
+		}
+	}
+	end = off;
+	if (hole && end - old + need <= ZRAMFS_INLINE_SIZE) {
+		//the records behind it move, their numbers don't
+		memmove(area + at + need, area + at + old, end - at - old);
+		if (need < old)
+			memset(area + end - old + need, 0, old - need);
+	} else {
+		if (end + need > ZRAMFS_INLINE_SIZE)
+			return -ENOSPC;
+		at = end;
+	}
+	de = (struct zramfs_inline_dirent *)(area + at);
+	de->ino = ino;
+	de->len = len;
+	memcpy(de->name, name, len);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/**
+ * point the record of name at ino, or empty it if ino is 0, dir_sem held
+ * exclusive. emptied records at the end are dropped.
+ */
+int zramfs_inline_dir_set(struct inode *dir, const char *name, int len, u32 ino)
+{
+	char *area = (char *)((struct gza_inode *)dir->i_private)->data;
+	struct zramfs_inline_dirent *de;
+	int off = 0, live = 0;
+	int found = 0;
+
+	while ((de = inline_next(dir, &off))) {
+		if (!found && de->ino && de->len == len && !memcmp(de->name, name, len)) {
+			de->ino = ino;
+			found = 1;
+		}
+		if (de->ino)
+			live = off;
+	}
+	if (!found)
+		return -ENOENT;
+	memset(area + live, 0, ZRAMFS_INLINE_SIZE - live);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/**
+ * 1 if an inline directory has no entry
+ */
+int zramfs_inline_dir_empty(struct inode *dir)
+{
+	struct zramfs_inline_dirent *de;
+	int off = 0;
+
+	while ((de = inline_next(dir, &off))) {
+		if (de->ino)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * readdir of an inline directory from position pos of filp on, dir_sem held
+ */
+void zramfs_inline_dir_readdir(struct inode *dir, struct file *filp, void *dirent, filldir_t filldir, int first)
+{
+	struct zramfs_inline_dirent *de;
+	int off = 0;
+	int n;
+
+	for (n = 0; (de = inline_next(dir, &off)); n++) {
+		if (n < filp->f_pos - first)
+			continue;
+		if (de->ino && filldir(dirent, de->name, de->len, filp->f_pos, de->ino, DT_UNKNOWN) < 0)
+			return;
+		filp->f_pos++;
+	}
+}
+
+/**
+ * move an inline directory to blocks, record n to slot n, dir_sem held
+ * exclusive
+ */
+int zramfs_inline_dir_convert(struct inode *dir)
+{
+	struct gza_inode *ginode = dir->i_private;
+	struct block_device *bdev = dir->i_sb->s_bdev;
+	int blk_bits = blksize_bits(bdev->bd_block_size);
+	int per_block = (1 << dir->i_blkbits) / DIRECTORY_SIZE;
+	char area[ZRAMFS_INLINE_SIZE];
+	struct zramfs_inline_dirent *de;
+	struct directory *dty;
+	struct buffer_head *bh;
+	int off = 0, offset;
+	int count, blocks;
+	int b, i, n;
+	u32 block;
+	int err;
+
+	for (count = 0; inline_next(dir, &off); count++)
+		;
+	blocks = count ? (count + per_block - 1) / per_block : 1;
+	memcpy(area, ginode->data, sizeof(area));
+	memset(ginode->data, 0, sizeof(ginode->data));
+	ginode->flags &= ~ZRAMFS_INODE_INLINE;
+
+	for (b = 0; b < blocks; b++) {
+		block = zramfs_get_data_block(dir, b);
+		if (!block) {
+			err = -ENOSPC;
+			goto undo;
+		}
+		for (i = 0; i < (1 << (dir->i_blkbits - blk_bits)); i++)
+			clear_bdev_block_content(bdev, ((sector_t)block << (dir->i_blkbits - blk_bits)) + i,
+					bdev->bd_block_size);
+		ginode->data[b] = block;
+	}
+
+	//inline_next walks data[], the records are in area now
+	off = 0;
+	for (n = 0; off + sizeof(*de) <= sizeof(area); n++) {
+		de = (struct zramfs_inline_dirent *)(area + off);
+		if (!de->len)
+			break;
+		off += INLINE_DIRENT_LEN(de->len);
+		if (!de->ino)
+			continue;
+		bh = zramfs_dir_bread(dir, n * DIRECTORY_SIZE, &offset);
+		if (!bh) {
+			err = -EIO;
+			goto undo;
+		}
+		lock_buffer(bh);
+		dty = (struct directory *)(kmap(bh->b_page) + bh_offset(bh) + offset);
+		memcpy(dty->d_name, de->name, de->len);
+		dty->d_len = de->len;
+		dty->d_num = de->ino;
+		dty->d_hash = zramfs_name_hash(de->name, de->len);
+		dty->d_status = 1;
+		kunmap(bh->b_page);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		put_bh(bh);
+	}
+	ZRAMFS_I(dir)->free_hint = 0;
+	mark_inode_dirty(dir);
+	printk(KERN_NOTICE "zramfs_inline_dir_convert, dir:%ld, records:%d, blocks:%d\n", dir->i_ino, count, blocks);
+	return 0;
+
+undo:
+	//the records are only in area, the directory stays inline
+	for (i = 0; i < b; i++)
+		zramfs_free_data_block(dir->i_sb, ginode->data[i]);
+	memcpy(ginode->data, area, sizeof(area));
+	ginode->flags |= ZRAMFS_INODE_INLINE;
+	return err;
+}
+
+/*
+ * free the indexes at the head of the lru, the ones looked up since the
+ * last pass get another round
+ */
+static int zramfs_index_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct zramfs_dir_index *idx;
+	struct zramfs_inode_info *info;
+	LIST_HEAD(dispose);
+
+	if (nr_to_scan) {
+		spin_lock(&zramfs_index_lru_lock);
+		while (nr_to_scan > 0 && !list_empty(&zramfs_index_lru)) {
+			idx = list_first_entry(&zramfs_index_lru, struct zramfs_dir_index, lru);
+			if (idx->referenced) {
+				idx->referenced = 0;
+				list_move_tail(&idx->lru, &zramfs_index_lru);
+				nr_to_scan--;
+				continue;
+			}
+			info = idx->info;
+			spin_lock(&info->index_lock);
+			info->index = NULL;
+			info->dir_gen++;
+			spin_unlock(&info->index_lock);
+			list_move(&idx->lru, &dispose);
+			nr_to_scan -= idx->count + 1;
+		}
+		spin_unlock(&zramfs_index_lru_lock);
+		while (!list_empty(&dispose)) {
+			idx = list_first_entry(&dispose, struct zramfs_dir_index, lru);
+			list_del(&idx->lru);
+			index_free(idx);
+		}
+	}
+	return (atomic_read(&zramfs_index_entries) / 100) * sysctl_vfs_cache_pressure;
+}
+
+static struct shrinker zramfs_index_shrinker = {
+	.shrink = zramfs_index_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+void zramfs_index_init(void)
+{
+	register_shrinker(&zramfs_index_shrinker);
+}
+
+void zramfs_index_exit(void)
+{
+	unregister_shrinker(&zramfs_index_shrinker);
+}
@@ -0,0 +1,196 @@
+/* discard.c: give free data blocks back to the device
+ *
+ * FITRIM walks the block bitmaps and discards the free runs. With the
+ * discard mount option freed blocks are queued here instead of being
+ * cleared, the worker discards them and only then clears their bits.
+ *
+ * This file is released under the GPL.
+ */
+
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+#include "internal.h"
+
+struct zramfs_discard {
+	struct list_head list;
+	unsigned int block;
+	unsigned int count;
+};
+
+static int zramfs_discard_run(struct super_block *sb, unsigned int block, unsigned int count)
+{
+	int shift = sb->s_blocksize_bits - 9;
+
+	return blkdev_issue_discard(sb->s_bdev, (sector_t)block << shift,
+			(sector_t)count << shift, GFP_NOFS, DISCARD_FL_WAIT);
+}
+
+/**
+ * used instead of clearing the bits when mounted with -o discard, blocks
+ * is sorted. the blocks stay allocated until the worker has discarded them.
+ */
+void zramfs_queue_discard(struct super_block *sb, unsigned int *blocks, int count)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_discard *d = NULL;
+	LIST_HEAD(runs);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (d && blocks[i] == d->block + d->count) {
+			d->count++;
+			continue;
+		}
+		d = kmalloc(sizeof(*d), GFP_NOFS);
+		if (!d) {
+			//no memory, the block is just freed without discard
+			zramfs_clear_block_run(sb, blocks[i], 1);
+			continue;
+		}
+		d->block = blocks[i];
+		d->count = 1;
+		list_add_tail(&d->list, &runs);
+	}
+	spin_lock(&fsi->discard_lock);
+	list_splice_tail(&runs, &fsi->discard_list);
+	spin_unlock(&fsi->discard_lock);
+	queue_work(zramfs_wq, &fsi->discard_work);
+}
+
+void zramfs_discard_worker(struct work_struct *work)
+{
+	struct ramfs_fs_info *fsi = container_of(work, struct ramfs_fs_info, discard_work);
+	struct super_block *sb = fsi->sb;
+	int supported = blk_queue_discard(bdev_get_queue(sb->s_bdev));
+	struct zramfs_discard *d, *tmp, *prev = NULL;
+	LIST_HEAD(runs);
+	int err;
+
+	spin_lock(&fsi->discard_lock);
+	list_splice_init(&fsi->discard_list, &runs);
+	spin_unlock(&fsi->discard_lock);
+
+	//frees queued one after the other often touch
+	list_for_each_entry_safe(d, tmp, &runs, list) {
+		if (prev && d->block == prev->block + prev->count) {
+			prev->count += d->count;
+			list_del(&d->list);
+			kfree(d);
+			continue;
+		}
+		prev = d;
+	}
+	list_for_each_entry_safe(d, tmp, &runs, list) {
+		if (supported) {
+			err = zramfs_discard_run(sb, d->block, d->count);
+			if (err && err != -EOPNOTSUPP)
+				printk(KERN_NOTICE "zramfs_discard_worker, block:%u, count:%u, err:%d\n", d->block, d->count, err);
+		}
+		zramfs_clear_block_run(sb, d->block, d->count);
+		list_del(&d->list);
+		kfree(d);
+	}
+}
+
+/*
+ * trim the free runs of at least minlen blocks in [from, to) of a group,
+ * returns the number of blocks discarded or an error
+ */
+static long zramfs_trim_group(struct super_block *sb, u32 group, u32 from, u32 to, u64 minlen)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+	loff_t begin = (loff_t)grp->desc.block_bitmap * sb->s_blocksize;
+	unsigned int bit = from;
+	unsigned int count;
+	long trimmed = 0;
+	int err = 0;
+
+	while (bit < to) {
+		mutex_lock(&grp->lock);
+		//a bitmap never written has nothing worth trimming, mkfs discarded it
+		count = 0;
+		if (!(grp->desc.flags & ZRAMFS_BG_BLOCK_UNINIT))
+			count = zramfs_find_free_run(sb, group, bit, to, to - bit, &bit);
+		//a run too short to trim is left alone, the bitmap stays clean
+		if (count && count < minlen) {
+			mutex_unlock(&grp->lock);
+			bit += count;
+			cond_resched();
+			continue;
+		}
+		if (count && !set_dev_bit_range(sb->s_bdev, begin, bit, count, SET))
+			grp->free_blocks -= count;
+		else
+			count = 0;
+		mutex_unlock(&grp->lock);
+		if (!count)
+			break;
+		err = zramfs_discard_run(sb, grp->begin + bit, count);
+		if (!err)
+			trimmed += count;
+		zramfs_clear_block_run(sb, grp->begin + bit, count);
+		if (err)
+			return err;
+		bit += count;
+		if (fatal_signal_pending(current))
+			return -ERESTARTSYS;
+		cond_resched();
+	}
+	return trimmed;
+}
+
+/**
+ * FITRIM: discard the free runs of at least minlen bytes in the range.
+ * a run is marked used while it is discarded so nobody allocates it, it
+ * never spans more than a group.
+ */
+int zramfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	int blkbits = sb->s_blocksize_bits;
+	u64 end_byte = range->start + range->len;
+	u64 start, end, minlen;
+	struct zramfs_group *grp;
+	u64 trimmed = 0;
+	u32 from, to, g;
+	long res;
+	int err = 0;
+
+	if (!blk_queue_discard(bdev_get_queue(sb->s_bdev)))
+		return -EOPNOTSUPP;
+	if (end_byte < range->start)
+		end_byte = ULLONG_MAX;
+	start = range->start >> blkbits;
+	end = end_byte >> blkbits;
+	minlen = range->minlen >> blkbits;
+	if (!minlen)
+		minlen = 1;
+	if (end > sbinfo->block_num)
+		end = sbinfo->block_num;
+
+	for (g = 0; g < sbinfo->group_count; g++) {
+		grp = zramfs_group(fsi, g);
+		if (grp->begin + grp->block_count <= start)
+			continue;
+		if (grp->begin >= end)
+			break;
+		//the metadata at the head of the group is never free
+		from = start > grp->begin ? start - grp->begin : 0;
+		to = end - grp->begin < grp->block_count ? end - grp->begin : grp->block_count;
+		res = zramfs_trim_group(sb, g, from, to, minlen);
+		if (res < 0) {
+			err = res;
+			break;
+		}
+		trimmed += res;
+	}
+	printk(KERN_NOTICE "zramfs_trim_fs, blocks:%llu-%llu, trimmed blocks:%llu, err:%d\n", start, end, trimmed, err);
+	range->len = trimmed << blkbits;
+	return err;
+}
@@ -28,9 +28,11 @@
 #include <linux/mm.h>
 #include <linux/ramfs.h>
 #include <linux/pagemap.h>
+#include <linux/xattr.h>
 #include <linux/buffer_head.h>
 #include <linux/highmem.h>
 #include <linux/mpage.h>
+#include <linux/falloc.h>
 
 #include "internal.h"
 
@@ -46,22 +48,27 @@ inline int  __set_page_dirty_no_writeback(struct page * page)
 int gfs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh, int create) 
 {
 	struct gza_inode *info = (struct gza_inode*)inode->i_private;
-	gzafs_sb_info *sbinfo = &((struct ramfs_fs_info *)inode->i_sb->s_fs_info)->sbinfo;
-	//int fs_blocksize_bits = inode->i_sb->s_blocksize_bits;
-	struct block_device *bdev = inode->i_sb->s_bdev;
-	int begin, end, new_num;
-	printk(KERN_NOTICE "gfs_get_block, inode->num:%ld,file block index:%lld, file block:%d,create:%d\n",inode->i_ino, iblock, info->data[iblock], create);
-	if (iblock > MAX_FILE_BLOCK_NUM)
+	u32 new_num;
+	if (iblock >= MAX_FILE_BLOCK_NUM)
 		return -ENOSPC;
+	printk(KERN_NOTICE "gfs_get_block, inode->num:%ld,file block index:%lld, file block:%u,create:%d\n",inode->i_ino, iblock, info->data[iblock], create);
 	
 	if (info->data[iblock] != 0)
 	{
-		//bh->b_blocknr = info->data[iblock];
-		//bh->b_bdev = bdev;
-		//set_buffer_mapped(bh);
-		//clear_buffer_new(bh);
-		
-		clear_buffer_new(bh);
+		if (!(info->unwritten & (1 << iblock))) {
+			clear_buffer_new(bh);
+			map_bh(bh, inode->i_sb, info->data[iblock]);
+			return 0;
+		}
+		//preallocated by fallocate, read it as a hole without io
+		if (!create) {
+			clear_buffer_mapped(bh);
+			return 0;
+		}
+		//first write, the caller zeroes what it doesn't write
+		info->unwritten &= ~(1 << iblock);
+		mark_inode_dirty(inode);
+		set_buffer_new(bh);
 		map_bh(bh, inode->i_sb, info->data[iblock]);
 		return 0;
 	}
@@ -72,29 +79,168 @@ int gfs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh,
 		return 0;
 	}
 	//alloc a new data bloc
-	begin = sbinfo->data_bitmap_begin << inode->i_blkbits;
-        end = (sbinfo->data_bitmap_begin + sbinfo->data_bitmap_block_num) << inode->i_blkbits;
-	//begin = sbinfo->data_bitmap_begin << fs_blocksize_bits;
-        //end = (sbinfo->data_bitmap_begin + sbinfo->data_bitmap_block_num) << fs_blocksize_bits;
-	new_num = find_valid_bit_num(bdev, begin, end);
-	printk(KERN_NOTICE "**gfs_get_block, find_valid_bit_num, inode:%ld, begin:%d, end:%d, result:%d\n",inode->i_ino, begin, end,  new_num);
-	if (! new_num)
+	new_num = zramfs_get_data_block(inode, iblock);
+	if (!new_num)
 		return -ENOSPC;
 
 	//update inode
-	info->data[iblock] = new_num + sbinfo->data_begin;
+	info->data[iblock] = new_num;
 	mark_inode_dirty(inode);
 	
 
-	printk(KERN_NOTICE "gfs_get_block, inode:%ld, file block:%lld, fs block:%d\n", inode->i_ino, iblock, new_num + sbinfo->data_begin);
-	//bh->b_blocknr = new_num;
-	//bh->b_bdev = bdev;
-	//set_buffer_mapped(bh);
+	printk(KERN_NOTICE "gfs_get_block, inode:%ld, file block:%lld, fs block:%u\n", inode->i_ino, iblock, new_num);
 	set_buffer_new(bh);
 	map_bh(bh, inode->i_sb, new_num);	
 	return 0;
 }
 
+/*
+ * zero [pos, pos + len) of one file block through the page cache.
+ * holes and preallocated blocks read as zero already, skip them.
+ */
+static int zramfs_zero_partial_block(struct inode *inode, loff_t pos, unsigned len)
+{
+	struct gza_inode *info = (struct gza_inode*)inode->i_private;
+	sector_t iblock = pos >> inode->i_blkbits;
+	loff_t size = i_size_read(inode);
+	struct page *page;
+	void *fsdata;
+	int err;
+
+	if (!len || pos >= size)
+		return 0;
+	if (pos + len > size)
+		len = size - pos;
+	if (iblock >= MAX_FILE_BLOCK_NUM || !info->data[iblock] ||
+			(info->unwritten & (1 << iblock)))
+		return 0;
+
+	err = pagecache_write_begin(NULL, inode->i_mapping, pos, len,
+			AOP_FLAG_UNINTERRUPTIBLE, &page, &fsdata);
+	if (err)
+		return err;
+	zero_user(page, pos & (PAGE_CACHE_SIZE - 1), len);
+	err = pagecache_write_end(NULL, inode->i_mapping, pos, len, len, page, fsdata);
+	return err < 0 ? err : 0;
+}
+
+/*
+ * punch or zero [offset, end). partial blocks at the edges are zeroed in the
+ * page cache, whole blocks are freed (punch) or turned into preallocated
+ * blocks (zero), so neither needs any data io.
+ */
+static int zramfs_clear_range(struct inode *inode, loff_t offset, loff_t end, int punch)
+{
+	struct gza_inode *info = (struct gza_inode*)inode->i_private;
+	struct address_space *mapping = inode->i_mapping;
+	unsigned blkbits = inode->i_blkbits;
+	sector_t first = (offset + (1 << blkbits) - 1) >> blkbits;
+	sector_t last = end >> blkbits;
+	loff_t lstart, lend;
+	sector_t i;
+	u32 new_num;
+	int err;
+
+	if (first > last)
+		return zramfs_zero_partial_block(inode, offset, end - offset);
+	err = zramfs_zero_partial_block(inode, offset, ((loff_t)first << blkbits) - offset);
+	if (!err)
+		err = zramfs_zero_partial_block(inode, (loff_t)last << blkbits,
+				end - ((loff_t)last << blkbits));
+	if (err || first == last)
+		return err;
+
+	//whole pages over the blocks leave the cache, the rest of them is on disk
+	lstart = ((loff_t)first << blkbits) & PAGE_CACHE_MASK;
+	lend = (((loff_t)last << blkbits) + PAGE_CACHE_SIZE - 1) & PAGE_CACHE_MASK;
+	err = filemap_write_and_wait_range(mapping, lstart, lend - 1);
+	if (err)
+		return err;
+	unmap_mapping_range(mapping, lstart, lend - lstart, 1);
+	truncate_inode_pages_range(mapping, lstart, lend - 1);
+
+	for (i = first; i < last; i++) {
+		if (punch) {
+			if (!info->data[i])
+				continue;
+			zramfs_free_data_block(inode->i_sb, info->data[i]);
+			info->data[i] = 0;
+			info->unwritten &= ~(1 << i);
+			continue;
+		}
+		if (!info->data[i]) {
+			new_num = zramfs_get_data_block(inode, i);
+			if (!new_num)
+				return -ENOSPC;
+			info->data[i] = new_num;
+		}
+		info->unwritten |= 1 << i;
+	}
+	return 0;
+}
+
+/**
+ * preallocation only reserves bits in the block bitmap and marks the
+ * blocks unwritten in the inode, no data block is written.
+ */
+long zramfs_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+	struct gza_inode *info = (struct gza_inode*)inode->i_private;
+	unsigned blkbits = inode->i_blkbits;
+	loff_t max = (loff_t)MAX_FILE_BLOCK_NUM << blkbits;
+	loff_t end = offset + len;
+	sector_t i;
+	u32 new_num;
+	int err = 0;
+
+	if (!S_ISREG(inode->i_mode))
+		return -ENODEV;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) &&
+			(!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE)))
+		return -EOPNOTSUPP;
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+	if (end > max) {
+		//nothing lives beyond the block map, there is nothing to punch
+		if (!(mode & FALLOC_FL_PUNCH_HOLE))
+			return -EFBIG;
+		end = max;
+		if (offset >= end)
+			return 0;
+	}
+
+	mutex_lock(&inode->i_mutex);
+	//preallocation is in blocks, an inline file needs one first
+	err = zramfs_inline_convert(inode);
+	if (err)
+		goto out;
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		err = zramfs_clear_range(inode, offset, end, mode & FALLOC_FL_PUNCH_HOLE);
+	} else {
+		for (i = offset >> blkbits; i <= (end - 1) >> blkbits; i++) {
+			if (info->data[i])
+				continue;
+			new_num = zramfs_get_data_block(inode, i);
+			if (!new_num) {
+				err = -ENOSPC;
+				break;
+			}
+			info->data[i] = new_num;
+			info->unwritten |= 1 << i;
+		}
+	}
+	printk(KERN_NOTICE "zramfs_fallocate, inode:%ld, mode:%x, offset:%lld, len:%lld, unwritten:%x, err:%d\n", inode->i_ino, mode, offset, len, info->unwritten, err);
+	if (!err && !(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+		i_size_write(inode, end);
+	inode->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(inode);
+out:
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+
 
 /*
 //block_prepare_write for help
@@ -274,18 +420,134 @@ int zramfs_write_begin(struct file* file, struct address_space *mapping, loff_t
 */
 
 
+/*
+ * inline files keep their bytes in data[] of the inode and have no block.
+ * their size stays within ZRAMFS_INLINE_SIZE, growing past it moves the
+ * bytes to block 0 first, so a page of one never holds more than data[].
+ */
+static void zramfs_inline_fill(struct inode *inode, struct page *page)
+{
+	struct gza_inode *info = (struct gza_inode*)inode->i_private;
+	loff_t size = i_size_read(inode);
+	unsigned len = 0;
+	void *kaddr;
+
+	if (page->index == 0)
+		len = size < ZRAMFS_INLINE_SIZE ? size : ZRAMFS_INLINE_SIZE;
+	kaddr = kmap_atomic(page, KM_USER0);
+	memcpy(kaddr, info->data, len);
+	memset(kaddr + len, 0, PAGE_CACHE_SIZE - len);
+	kunmap_atomic(kaddr, KM_USER0);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+}
+
+/*
+ * copy [pos, pos + len) of page 0 into data[]
+ */
+static void zramfs_inline_store(struct inode *inode, struct page *page, unsigned pos, unsigned len)
+{
+	struct gza_inode *info = (struct gza_inode*)inode->i_private;
+	void *kaddr;
+
+	if (pos >= ZRAMFS_INLINE_SIZE)
+		return;
+	if (pos + len > ZRAMFS_INLINE_SIZE)
+		len = ZRAMFS_INLINE_SIZE - pos;
+	kaddr = kmap_atomic(page, KM_USER0);
+	memcpy((char *)info->data + pos, kaddr + pos, len);
+	kunmap_atomic(kaddr, KM_USER0);
+	mark_inode_dirty(inode);
+}
+
+/**
+ * move the bytes of an inline file to a block of its own, i_mutex held.
+ * page 0 is locked before the flag goes, zramfs_write_page checks it
+ * under that lock.
+ */
+int zramfs_inline_convert(struct inode *inode)
+{
+	struct gza_inode *info = (struct gza_inode*)inode->i_private;
+	struct address_space *mapping = inode->i_mapping;
+	loff_t size = i_size_read(inode);
+	unsigned len = size < ZRAMFS_INLINE_SIZE ? size : ZRAMFS_INLINE_SIZE;
+	char buf[ZRAMFS_INLINE_SIZE];
+	struct page *page;
+	int err = 0;
+
+	if (!zramfs_inline(inode))
+		return 0;
+	page = grab_cache_page_write_begin(mapping, 0, AOP_FLAG_UNINTERRUPTIBLE);
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page))
+		zramfs_inline_fill(inode, page);
+	memcpy(buf, info->data, sizeof(buf));
+	memset(info->data, 0, sizeof(info->data));
+	info->flags &= ~ZRAMFS_INODE_INLINE;
+	//the page holds the bytes, map block 0 under it and dirty it
+	if (len) {
+		err = block_prepare_write(page, 0, len, gfs_get_block);
+		if (!err)
+			err = block_commit_write(page, 0, len);
+	}
+	if (err && !info->data[0]) {
+		//no block was taken, the file stays inline
+		memcpy(info->data, buf, sizeof(buf));
+		info->flags |= ZRAMFS_INODE_INLINE;
+	}
+	mark_inode_dirty(inode);
+	unlock_page(page);
+	page_cache_release(page);
+	printk(KERN_NOTICE "zramfs_inline_convert, inode:%ld, size:%lld, err:%d\n", inode->i_ino, size, err);
+	return err;
+}
+
 int zramfs_write_begin(struct file* file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **page, void ** fsdata) 
 {
+	struct inode *inode = mapping->host;
+	struct page *pg;
+	int err;
+
 	*page = NULL;
+	if (zramfs_inline(inode)) {
+		if (pos + len <= ZRAMFS_INLINE_SIZE) {
+			pg = grab_cache_page_write_begin(mapping, 0, flags);
+			if (!pg)
+				return -ENOMEM;
+			if (!PageUptodate(pg))
+				zramfs_inline_fill(inode, pg);
+			*page = pg;
+			return 0;
+		}
+		err = zramfs_inline_convert(inode);
+		if (err)
+			return err;
+	}
 	return block_write_begin(file, mapping, pos, len, flags,page ,fsdata,gfs_get_block);
 }
 
+/*
+ * the page stays clean, the bytes are on disk with the inode
+ */
+static int zramfs_inline_write_end(struct inode *inode, loff_t pos, unsigned copied, struct page *page)
+{
+	zramfs_inline_store(inode, page, pos, copied);
+	if (pos + copied > inode->i_size)
+		i_size_write(inode, pos + copied);
+	unlock_page(page);
+	page_cache_release(page);
+	return copied;
+}
+
 int zramfs_generic_write_end(struct file *file, struct address_space *mapping,
 			loff_t pos, unsigned len, unsigned copied,
 			struct page *page, void *fsdata)
 {
 	int err;
 	struct inode *inode;
+	if (zramfs_inline(mapping->host))
+		return zramfs_inline_write_end(mapping->host, pos, copied, page);
 	//when  write inode directly, the file is null, look page_symlink
 	if (file) {
 		inode = file->f_dentry->d_inode;
@@ -300,12 +562,27 @@ int zramfs_generic_write_end(struct file *file, struct address_space *mapping,
 
 int zramfs_read_page(struct file* file, struct page* page)
 {
+	if (zramfs_inline(page->mapping->host)) {
+		zramfs_inline_fill(page->mapping->host, page);
+		unlock_page(page);
+		return 0;
+	}
 	return mpage_readpage(page, gfs_get_block);
 }
 
 int zramfs_write_page(struct page *page, struct writeback_control *wbc) 
 {
+	struct inode *inode = page->mapping->host;
+	loff_t size = i_size_read(inode);
+
 	printk(KERN_NOTICE "zramfs_write_page ****************");
+	//dirtied through a mapping, only the bytes inside i_size count
+	if (zramfs_inline(inode)) {
+		if (page->index == 0)
+			zramfs_inline_store(inode, page, 0, size);
+		unlock_page(page);
+		return 0;
+	}
 	return block_write_full_page(page, gfs_get_block, wbc);
 }
 
@@ -330,10 +607,77 @@ const struct file_operations ramfs_file_operations = {
 	.splice_read	= generic_file_splice_read,
 	.splice_write	= generic_file_splice_write,
 	.llseek		= generic_file_llseek,
+	.unlocked_ioctl	= zramfs_ioctl,
 };
 
+/**
+ * called by vmtruncate once i_size and the page cache are cut down,
+ * blocks past the new size, preallocated ones too, are freed in one batch.
+ */
+void zramfs_truncate(struct inode *inode)
+{
+	struct gza_inode *info = (struct gza_inode*)inode->i_private;
+	unsigned blkbits = inode->i_blkbits;
+	sector_t first = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+	unsigned int blocks[INODE_DATA_COUNT];
+	int count = 0;
+	sector_t i;
+
+	if (!S_ISREG(inode->i_mode))
+		return;
+	if (zramfs_inline(inode)) {
+		if (i_size_read(inode) < ZRAMFS_INLINE_SIZE)
+			memset((char *)info->data + i_size_read(inode), 0,
+					ZRAMFS_INLINE_SIZE - i_size_read(inode));
+		inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+		mark_inode_dirty(inode);
+		return;
+	}
+	//the tail of the last block must read as zero if the file grows again
+	block_truncate_page(inode->i_mapping, i_size_read(inode), gfs_get_block);
+
+	for (i = first; i < MAX_FILE_BLOCK_NUM; i++) {
+		if (!info->data[i])
+			continue;
+		blocks[count++] = info->data[i];
+		info->data[i] = 0;
+		info->unwritten &= ~(1 << i);
+	}
+	printk(KERN_NOTICE "zramfs_truncate, inode:%ld, size:%lld, free blocks:%d\n", inode->i_ino, i_size_read(inode), count);
+	inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(inode);
+	zramfs_release_blocks(inode->i_sb, blocks, count, 0);
+}
+
+static int zramfs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = dentry->d_inode;
+	int err;
+
+	err = inode_change_ok(inode, attr);
+	if (err)
+		return err;
+	if ((attr->ia_valid & ATTR_SIZE) &&
+			attr->ia_size > ((loff_t)MAX_FILE_BLOCK_NUM << inode->i_blkbits))
+		return -EFBIG;
+	if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size > ZRAMFS_INLINE_SIZE) {
+		err = zramfs_inline_convert(inode);
+		if (err)
+			return err;
+	}
+	//a size change goes through vmtruncate and zramfs_truncate
+	return inode_setattr(inode, attr);
+}
+
 const struct inode_operations ramfs_file_inode_operations = {
+	.setattr	= zramfs_setattr,
+	.truncate	= zramfs_truncate,
 	.getattr	= simple_getattr,
+	.fallocate	= zramfs_fallocate,
+	.setxattr	= generic_setxattr,
+	.getxattr	= generic_getxattr,
+	.listxattr	= zramfs_listxattr,
+	.removexattr	= generic_removexattr,
 };
 
 
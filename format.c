@@ -1,141 +1,466 @@
 #include<stdio.h>
+#include<stdlib.h>
 #include<unistd.h>
 #include<fcntl.h>
 #include<errno.h>
 #include<memory.h>
-#include<linux/if_packet.h>
+#include<string.h>
+#include<sys/ioctl.h>
+#include<sys/stat.h>
+#include<time.h>
+#include<linux/types.h>
+#include<linux/fs.h>
 
 typedef struct
 {
-	__u32 inode_bitmap_begin;
-	__u32 inode_bitmap_block_num;
+	__u32 inodes_per_group;
+	__u32 blocks_per_group;
 	__u32 inode_num;
-	__u32 data_bitmap_begin;
-	__u32 data_bitmap_block_num;
+	__u32 group_count;
+	__u32 gdt_begin;
+	__u32 gdt_block_num;
+	__u32 first_group_block;
+	__u32 block_num;
+	__u32 itable_block_num;
 	__u32 data_num;
-	__u32 inode_begin;
-	__u32 inode_block_num;
-	__u32 data_begin;
-	__u32 data_block_num;
 	__u32 block_size;
-	
+
 	__u32 magic;
+	__u32 orphan_head;
+	__u32 flags;
+	__u32 inode_size;
+	__u32 rev_level;
+	__u32 feature_compat;
+	__u32 feature_incompat;
+	__u32 feature_ro_compat;
 
 } __attribute__ ((packed)) gzafs_sb_info;
 
-#define BLOCK_SIZE 1024
-struct gza_inode 
+#define ZRAMFS_SB_UNINIT 0x0001
+#define ZRAMFS_SB_GROUPS 0x0002
+
+#define ZRAMFS_REV_LEVEL 1
+
+#define ZRAMFS_FEATURE_COMPAT_XATTR		0x0001
+#define ZRAMFS_FEATURE_INCOMPAT_INLINE_DATA	0x0001
+#define ZRAMFS_FEATURE_INCOMPAT_INODE_V2	0x0002
+#define ZRAMFS_FEATURE_INCOMPAT_BLOCKS32	0x0004
+
+struct zramfs_group_desc {
+	__u32 block_bitmap;
+	__u32 inode_bitmap;
+	__u32 inode_table;
+	__u32 flags;
+	__u32 itable_inited;
+	__u32 used_dirs;
+	__u32 reserved[2];
+};
+
+#define ZRAMFS_BG_BLOCK_UNINIT 0x0001
+#define ZRAMFS_BG_INODE_UNINIT 0x0002
+
+#define DEFAULT_BLOCK_SIZE 4096
+struct gza_inode
 {
 	__u32 num;
-	umode_t mode;
+	__u16 mode;
+	__u16 unwritten;
 	int length;
-	dev_t dev;
+	__u32 dev;	/* the kernel dev_t */
 	unsigned int data[10];
-};
+	__u32 next_orphan;
+	__u32 flags;
+	/* version 2 */
+	__u32 size_high;
+	__u32 nlink;
+	__u32 uid;
+	__u32 gid;
+	__u64 atime;
+	__u64 mtime;
+	__u64 ctime;
+	__u32 atime_nsec;
+	__u32 mtime_nsec;
+	__u32 ctime_nsec;
+	__u32 xattr_block;
+	__u8 xattr[128];
+	__u32 reserved[2];
+} __attribute__ ((packed));
 #define INODE_SIZE 64
+#define INODE_SIZE_V2 256
 #define ROOT_INODE_NUM 1
 #define RESERVE_INODE_NUM 0
 
-int main(int argc, char* argv[])
+#define BYTES_PER_INODE 16384
+/* block numbers are 32 bit, 0 is the super block */
+#define MAX_BLOCKS 0xffffffffULL
+/* past this older kernels, which keep block numbers in int, can't mount it */
+#define INT_BLOCKS 0x7fffffffULL
+/* the kernel keeps inode numbers in int */
+#define MAX_INODES 0x7fffffffULL
+#define ZERO_CHUNK (1 << 20)
+/* a short last group needs this many data blocks, or it is left out */
+#define MIN_GROUP_DATA 16
+/* by default there is room in the descriptor table to grow this many times */
+#define RESIZE_FACTOR 1024
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-b block-size] [-I inode-size] [-i bytes-per-inode] [-N inodes] [-R max-size] [-K] [-z] device\n", prog);
+	printf("  -b  1024, 2048 or 4096, default %d\n", DEFAULT_BLOCK_SIZE);
+	printf("  -I  %d (size, times and owner kept) or %d (old layout), default %d\n",
+			INODE_SIZE_V2, INODE_SIZE, INODE_SIZE_V2);
+	printf("  -i  one inode per this many bytes of the device, default %d\n", BYTES_PER_INODE);
+	printf("  -N  number of inodes, overrides -i\n");
+	printf("  -R  bytes the volume may be grown to online, default %d times the device\n", RESIZE_FACTOR);
+	printf("  -K  keep the device content, don't discard it first\n");
+	printf("  -z  initialise all groups now instead of after mount\n");
+}
+
+static int write_all(int fp, const void *buf, size_t len, __u64 offset)
 {
+	const char *p = buf;
+	ssize_t res;
+	while (len > 0) {
+		res = pwrite(fp, p, len, offset);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += res;
+		len -= res;
+		offset += res;
+	}
+	return 0;
+}
+
+/* logical sector size, the kernel can't use smaller blocks on the device */
+static int sector_size(int fp)
+{
+	struct stat st;
+	int size = 512;
+	if (fstat(fp, &st) < 0 || !S_ISBLK(st.st_mode))
+		return size;
+	if (ioctl(fp, BLKSSZGET, &size) < 0)
+		return 512;
+	return size;
+}
+
+static __u64 device_size(int fp)
+{
+	struct stat st;
+	__u64 size = 0;
+	if (fstat(fp, &st) < 0)
+		return 0;
+	if (!S_ISBLK(st.st_mode))
+		return st.st_size;
+	if (ioctl(fp, BLKGETSIZE64, &size) < 0)
+		return 0;
+	return size;
+}
+
+/*
+ * discard the whole device, returns 1 when the discarded blocks are known
+ * to read back as zeros afterwards
+ */
+static int discard_device(int fp, __u64 size)
+{
+	__u64 range[2] = {0, size};
+	unsigned int zeroes = 0;
+	struct stat st;
+	if (fstat(fp, &st) < 0 || !S_ISBLK(st.st_mode))
+		return 0;
+	if (ioctl(fp, BLKDISCARD, &range) < 0)
+		return 0;
+#ifdef BLKDISCARDZEROES
+	if (ioctl(fp, BLKDISCARDZEROES, &zeroes) < 0)
+		zeroes = 0;
+#endif
+	return zeroes != 0;
+}
+
+/*
+ * zero [start, start + len) with BLKZEROOUT when the device has it,
+ * otherwise with large writes
+ */
+static int zero_range(int fp, __u64 start, __u64 len)
+{
+	static char *zero;
+	size_t count;
+#ifdef BLKZEROOUT
+	__u64 range[2] = {start, len};
+	struct stat st;
+	if (!fstat(fp, &st) && S_ISBLK(st.st_mode) && !ioctl(fp, BLKZEROOUT, &range))
+		return 0;
+#endif
+	if (!zero) {
+		zero = calloc(1, ZERO_CHUNK);
+		if (!zero)
+			return -1;
+	}
+	while (len > 0) {
+		count = len > ZERO_CHUNK ? ZERO_CHUNK : len;
+		if (write_all(fp, zero, count, start) < 0)
+			return -1;
+		start += count;
+		len -= count;
+	}
+	return 0;
+}
+
+/*
+ * write a one block bitmap: the first head bits and the bits from valid on
+ * set, everything else clear
+ */
+static int write_bitmap(int fp, __u32 block, __u32 block_size, __u32 head, __u32 valid)
+{
+	unsigned char *map = calloc(1, block_size);
+	__u32 bit;
 	int res;
-	int cur = 0;
-	int count = 0;
-	int data = 0;
-	int i;
+	if (!map)
+		return -1;
+	for (bit = 0; bit < block_size * 8; bit++)
+		if (bit < head || bit >= valid)
+			map[bit >> 3] |= 1 << (bit & 0x07);
+	res = write_all(fp, map, block_size, (__u64)block * block_size);
+	free(map);
+	return res;
+}
+
+static __u32 div_up(__u64 a, __u64 b)
+{
+	return (a + b - 1) / b;
+}
+
+int main(int argc, char* argv[])
+{
 	gzafs_sb_info sb;
+	struct zramfs_group_desc *gdt;
 	struct gza_inode ginode;
-	
-	ginode.num = 1;
-	ginode.mode = 00777 | 0040000;
-	ginode.dev = 0;
-	ginode.length = 0;
-	memset(ginode.data,0,sizeof(ginode.data));
+	__u32 block_size = DEFAULT_BLOCK_SIZE;
+	__u32 inode_size = INODE_SIZE_V2;
+	__u64 bytes_per_inode = BYTES_PER_INODE;
+	__u64 inodes = 0;
+	__u64 max_size = 0;
+	int discard = 1;
+	int zeroed = 0;
+	int lazy = 1;
+	__u64 size, blocks, max_blocks, avail, tail;
+	__u32 groups, per_block, meta, begin, count, g;
+	__u32 sector;
+	char *block;
+	int opt;
+	int fp;
 
-	if (argc < 2) 
+	while ((opt = getopt(argc, argv, "b:I:i:N:R:Kzh")) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			inode_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			bytes_per_inode = strtoull(optarg, NULL, 0);
+			break;
+		case 'N':
+			inodes = strtoull(optarg, NULL, 0);
+			break;
+		case 'R':
+			max_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'K':
+			discard = 0;
+			break;
+		case 'z':
+			lazy = 0;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc)
 	{
-		printf("param is error!");
-		printf("error: %s\n", strerror(errno));
+		usage(argv[0]);
+		return 1;
+	}
+	if (block_size != 1024 && block_size != 2048 && block_size != 4096) {
+		printf("block size %u is not supported\n", block_size);
 		return 1;
 	}
+	if (inode_size != INODE_SIZE && inode_size != INODE_SIZE_V2) {
+		printf("inode size %u is not supported\n", inode_size);
+		return 1;
+	}
+	if (bytes_per_inode < block_size)
+		bytes_per_inode = block_size;
 
-	int fp = open(argv[1], O_RDWR);
-	if (fp <0) 
-	{
-		printf("open failed.");
-		return;
-	}
-	
-	sb.inode_bitmap_begin = 1;
-	sb.inode_bitmap_block_num = 1;
-	sb.data_bitmap_begin = 2;
-	sb.data_bitmap_block_num = 1;
-	sb.inode_begin = 3;
-	sb.inode_block_num = 3;
-	sb.data_begin = sb.inode_begin + sb.inode_block_num;
-       	sb.data_block_num = 100;
-	sb.inode_num = (BLOCK_SIZE/32)*sb.inode_block_num;
-	sb.data_num = sb.data_block_num;
-	sb.block_size = BLOCK_SIZE;
-	
-	sb.magic = 0x12341234;
-	
-	res = lseek(fp, 0, SEEK_CUR);
-	if (res == -1)
+	fp = open(argv[optind], O_RDWR);
+	if (fp <0)
 	{
-		printf("seek error");
-		return;
+		printf("open failed: %s\n", strerror(errno));
+		return 1;
 	}
-	
-	res = write(fp, &sb, sizeof(sb));
-	if (res == -1)
-	{
-		printf("write error");
-		return;
+	sector = sector_size(fp);
+	if (block_size < sector) {
+		printf("block size %u is smaller than the device sector size %u\n", block_size, sector);
+		return 1;
+	}
+	size = device_size(fp);
+	blocks = size / block_size;
+	if (blocks > MAX_BLOCKS) {
+		printf("only the first %llu blocks of the device are used\n", MAX_BLOCKS);
+		blocks = MAX_BLOCKS;
 	}
-	cur =  lseek(fp, sb.inode_bitmap_begin * BLOCK_SIZE, SEEK_SET);
 
-	if (res == -1)	
-	{
-		printf("seek error");
-		return;
+	//online resize appends groups, their descriptors go in the reserved room
+	if (max_size)
+		max_blocks = max_size / block_size;
+	else
+		max_blocks = blocks * RESIZE_FACTOR;
+	if (max_blocks > MAX_BLOCKS)
+		max_blocks = MAX_BLOCKS;
+	if (max_blocks < blocks)
+		max_blocks = blocks;
+
+	//super block, group descriptors, then the groups, one bitmap block each
+	memset(&sb, 0, sizeof(sb));
+	sb.blocks_per_group = block_size * 8;
+	groups = div_up(max_blocks, sb.blocks_per_group);
+	sb.gdt_begin = 1;
+	sb.gdt_block_num = div_up((__u64)groups * sizeof(struct zramfs_group_desc), block_size);
+	if (blocks < 1 + sb.gdt_block_num) {
+		printf("device is too small, %llu bytes\n", size);
+		return 1;
 	}
-	count = (sb.inode_bitmap_block_num + sb.data_bitmap_block_num)*BLOCK_SIZE/sizeof(data);
-	printf("format, begin:%d, num:%d",cur, count* sizeof(data));
-	for (i = 0;i< count;i++) 
-	{
-		write(fp, &data, sizeof(data));
+	avail = blocks - 1 - sb.gdt_block_num;
+	groups = div_up(avail, sb.blocks_per_group);
+
+	//inode table slice of a group, rounded up to whole blocks
+	if (!inodes)
+		inodes = blocks * block_size / bytes_per_inode;
+	per_block = block_size / inode_size;
+	sb.inodes_per_group = div_up(div_up(inodes, groups), per_block) * per_block;
+	if (sb.inodes_per_group < per_block)
+		sb.inodes_per_group = per_block;
+	if (sb.inodes_per_group > block_size * 8)
+		sb.inodes_per_group = block_size * 8;
+	while ((__u64)groups * sb.inodes_per_group > MAX_INODES)
+		sb.inodes_per_group -= per_block;
+	sb.itable_block_num = sb.inodes_per_group / per_block;
+	meta = 2 + sb.itable_block_num;
+
+	//a short last group only if it has room for some data
+	groups = avail / sb.blocks_per_group;
+	tail = avail % sb.blocks_per_group;
+	if (tail >= meta + MIN_GROUP_DATA)
+		groups++;
+	else
+		avail -= tail;
+	if (!groups) {
+		printf("device is too small, %llu bytes\n", size);
+		return 1;
 	}
-	//init 0 data bit, reserve the first bit
-	cur =  lseek(fp, sb.data_bitmap_begin * BLOCK_SIZE, SEEK_SET);
-	if (res == -1)	
-	{
-		printf("seek error");
-		return;
-	}
-	
-	data = 1;
-	write(fp, &data, sizeof(data));
-	
-	
+	sb.group_count = groups;
+	sb.first_group_block = 1 + sb.gdt_block_num;
+	sb.block_num = sb.first_group_block + avail;
+	sb.inode_num = groups * sb.inodes_per_group;
+	sb.data_num = avail - (__u64)groups * meta;
+	sb.block_size = block_size;
+
+	sb.magic = 0x12341234;
+	sb.orphan_head = 0;
+	sb.flags = ZRAMFS_SB_GROUPS;
+	//0 is read as the old 64 byte inode
+	sb.inode_size = inode_size == INODE_SIZE ? 0 : inode_size;
+	//lazy: the kernel initialises the other groups on first use
+	if (lazy)
+		sb.flags |= ZRAMFS_SB_UNINIT;
+	//the kernel keeps small files, symlinks and directories in the inode
+	sb.rev_level = ZRAMFS_REV_LEVEL;
+	sb.feature_incompat = ZRAMFS_FEATURE_INCOMPAT_INLINE_DATA;
+	if (inode_size == INODE_SIZE_V2) {
+		sb.feature_incompat |= ZRAMFS_FEATURE_INCOMPAT_INODE_V2;
+		sb.feature_compat |= ZRAMFS_FEATURE_COMPAT_XATTR;
+	}
+	if (sb.block_num > INT_BLOCKS)
+		sb.feature_incompat |= ZRAMFS_FEATURE_INCOMPAT_BLOCKS32;
+
+	printf("format, revision:%u, features:%x/%x/%x, block size:%u, inode size:%u, blocks:%u, groups:%u, inodes per group:%u, inode table blocks per group:%u, data blocks:%u%s\n",
+			sb.rev_level, sb.feature_compat, sb.feature_incompat, sb.feature_ro_compat,
+			block_size, inode_size, sb.block_num, groups, sb.inodes_per_group, sb.itable_block_num, sb.data_num,
+			lazy ? ", lazy init" : "");
+	printf("room for %u group descriptors, blocks:%llu\n",
+			sb.gdt_block_num * (block_size / (__u32)sizeof(struct zramfs_group_desc)),
+			(__u64)sb.gdt_block_num * (block_size / sizeof(struct zramfs_group_desc)) * sb.blocks_per_group);
+
+	if (discard)
+		zeroed = discard_device(fp, size);
+
+	gdt = calloc(sb.gdt_block_num, block_size);
+	if (!gdt)
+		return 1;
+	for (g = 0; g < groups; g++) {
+		begin = sb.first_group_block + g * sb.blocks_per_group;
+		count = sb.block_num - begin < sb.blocks_per_group ? sb.block_num - begin : sb.blocks_per_group;
+		gdt[g].block_bitmap = begin;
+		gdt[g].inode_bitmap = begin + 1;
+		gdt[g].inode_table = begin + 2;
+		if (lazy && g) {
+			gdt[g].flags = ZRAMFS_BG_BLOCK_UNINIT | ZRAMFS_BG_INODE_UNINIT;
+			continue;
+		}
+		//group 0 of a lazy format only needs the table block of the root
+		gdt[g].itable_inited = lazy ? 1 : sb.itable_block_num;
+		if (!zeroed && zero_range(fp, (__u64)gdt[g].inode_table * block_size,
+					(__u64)gdt[g].itable_inited * block_size) < 0) {
+			printf("zero inode table error: %s\n", strerror(errno));
+			return 1;
+		}
+		if (write_bitmap(fp, gdt[g].block_bitmap, block_size, meta, count) < 0) {
+			printf("write block bitmap error: %s\n", strerror(errno));
+			return 1;
+		}
+		//inode 0 is reserved, 1 is the root directory
+		if (write_bitmap(fp, gdt[g].inode_bitmap, block_size, g ? 0 : ROOT_INODE_NUM + 1,
+					sb.inodes_per_group) < 0) {
+			printf("write inode bitmap error: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+	gdt[0].used_dirs = 1;
+	if (write_all(fp, gdt, (size_t)sb.gdt_block_num * block_size, (__u64)sb.gdt_begin * block_size) < 0) {
+		printf("write group descriptors error: %s\n", strerror(errno));
+		return 1;
+	}
+	free(gdt);
+
 	//init root directory
-	cur =  lseek(fp, sb.inode_bitmap_begin * BLOCK_SIZE, SEEK_SET);
-	if (res == -1)	
-	{
-		printf("seek error");
-		return;
-	}
-	
-	data = 1 << ROOT_INODE_NUM;
-	data |= 1 << RESERVE_INODE_NUM; 
-	write(fp, &data, sizeof(data));
-	
-	cur =  lseek(fp, (sb.inode_begin * BLOCK_SIZE) + INODE_SIZE * ROOT_INODE_NUM, SEEK_SET);
-	if (res == -1)	
-	{
-		printf("seek error");
-		return;
+	memset(&ginode, 0, sizeof(ginode));
+	ginode.num = ROOT_INODE_NUM;
+	ginode.mode = 00777 | 0040000;
+	ginode.nlink = 2;
+	ginode.uid = getuid();
+	ginode.gid = getgid();
+	ginode.atime = ginode.mtime = ginode.ctime = time(NULL);
+	if (write_all(fp, &ginode, inode_size,
+				(__u64)(sb.first_group_block + 2) * block_size + inode_size * ROOT_INODE_NUM) < 0) {
+		printf("write root inode error: %s\n", strerror(errno));
+		return 1;
+	}
+
+	//super block last, a whole block so the unused tail is zero
+	block = calloc(1, block_size);
+	if (!block)
+		return 1;
+	memcpy(block, &sb, sizeof(sb));
+	if (write_all(fp, block, block_size, 0) < 0) {
+		printf("write super block error: %s\n", strerror(errno));
+		return 1;
 	}
-	
-	write(fp, &ginode, sizeof(struct gza_inode));
-}	
+	free(block);
+	fsync(fp);
+	close(fp);
+	return 0;
+}
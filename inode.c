@@ -34,10 +34,13 @@
 #include <linux/ramfs.h>
 #include <linux/sched.h>
 #include <linux/parser.h>
+#include <linux/namei.h>
 #include <linux/magic.h>
 #include <linux/types.h>
 #include <linux/buffer_head.h>
 #include <linux/blkdev.h>
+#include <linux/workqueue.h>
+#include <linux/xattr.h>
 #include <asm/uaccess.h>
 #include "internal.h"
 
@@ -49,15 +52,33 @@ static const struct file_operations zramfs_dir_operations;
 
 enum {
 	Opt_mode,
+	Opt_async_free,
+	Opt_async_free_blocks,
+	Opt_discard,
+	Opt_nodiscard,
+	Opt_nolazyinit,
+	Opt_lazytime,
+	Opt_lazytime_age,
+	Opt_nolazytime,
 	Opt_err
 };
 
 
 static const match_table_t tokens = {
 	{Opt_mode, "mode=%o"},
+	{Opt_async_free, "async_free"},
+	{Opt_async_free_blocks, "async_free=%u"},
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_nolazyinit, "nolazyinit"},
+	{Opt_lazytime, "lazytime"},
+	{Opt_lazytime_age, "lazytime=%u"},
+	{Opt_nolazytime, "nolazytime"},
 	{Opt_err, NULL}
 };
 
+struct workqueue_struct *zramfs_wq;
+
 
 
 static struct backing_dev_info ramfs_backing_dev_info = {
@@ -218,38 +239,70 @@ end:
 }
 */
 
-int zramfs_find_valid_inode_num(struct super_block *sb) 
+/*
+ * fast symlinks: a target that fits, its nul included, is kept in data[]
+ * with ZRAMFS_INODE_INLINE set and followed without any io
+ */
+static void *zramfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 {
-	
-	gzafs_sb_info *gzsb = &((struct ramfs_fs_info*)sb->s_fs_info)->sbinfo; 
-	int block_bits = sb->s_blocksize_bits;
-	int begin =  gzsb->inode_bitmap_begin << block_bits;
-	int end = (gzsb->inode_bitmap_begin + gzsb->inode_bitmap_block_num) << block_bits;
-	int num = find_valid_bit_num(sb->s_bdev, begin, end);
- 	printk("*** find valid inode:%d, begin:%d, end:%d\n", num, begin, end);
-	return num;	
+	struct gza_inode *ginode = dentry->d_inode->i_private;
+
+	nd_set_link(nd, (char *)ginode->data);
+	return NULL;
+}
+
+static const struct inode_operations zramfs_fast_symlink_inode_operations = {
+	.readlink	= generic_readlink,
+	.follow_link	= zramfs_follow_link,
+	.setxattr	= generic_setxattr,
+	.getxattr	= generic_getxattr,
+	.listxattr	= zramfs_listxattr,
+	.removexattr	= generic_removexattr,
+};
+
+/* page_symlink_inode_operations with attributes */
+static const struct inode_operations zramfs_symlink_inode_operations = {
+	.readlink	= generic_readlink,
+	.follow_link	= page_follow_link_light,
+	.put_link	= page_put_link,
+	.setxattr	= generic_setxattr,
+	.getxattr	= generic_getxattr,
+	.listxattr	= zramfs_listxattr,
+	.removexattr	= generic_removexattr,
+};
 
+static struct zramfs_inode_info *zramfs_alloc_info(void)
+{
+	struct zramfs_inode_info *info = kzalloc(sizeof(struct zramfs_inode_info), GFP_KERNEL);
+	if (info) {
+		INIT_LIST_HEAD(&info->orphan);
+		init_rwsem(&info->dir_sem);
+		spin_lock_init(&info->index_lock);
+		init_rwsem(&info->xattr_sem);
+	}
+	return info;
 }
 
-struct inode* zramfs_get_inode(struct super_block *sb, int mode, dev_t dev)
+struct inode* zramfs_get_inode(struct super_block *sb, const struct inode *dir, int mode, dev_t dev)
 {
-	//struct block_device *bdev = sb->s_bdev;
-	//gzafs_sb_info *gzsb = &((struct ramfs_fs_info*)sb->s_fs_info)->sbinfo; 
 	struct inode *inode;
-	//int block_size = bdev->bd_block_size;
-	//int block_bits = bdev->bd_inode->i_blkbits;
-	//int begin =  gzsb->inode_bitmap_begin << block_bits;
-	//int end = (gzsb->inode_bitmap_begin + gzsb->inode_bitmap_block_num) << block_bits;
-	int num = zramfs_find_valid_inode_num(sb);
+	int num = zramfs_new_inode_num(sb, dir, mode);
+	struct zramfs_inode_info *info;
 	struct gza_inode * ginode;
         int res = 0;	
 	if (!num)
 		return NULL;
+	zramfs_init_itable(sb, num);
 	inode = new_inode(sb);
-	ginode = kzalloc(sizeof(struct gza_inode), GFP_KERNEL);
+	info = zramfs_alloc_info();
+	ginode = &info->ginode;
 	ginode->num = num;
 	ginode->mode = mode;
         ginode->length = 0;	
+	//small files and directories never get a block, once the volume says so
+	if ((S_ISREG(mode) || S_ISDIR(mode)) &&
+			!zramfs_set_feature_incompat(sb, ZRAMFS_FEATURE_INCOMPAT_INLINE_DATA))
+		ginode->flags = ZRAMFS_INODE_INLINE;
 	inode->i_mode = mode;
 	inode->i_private = ginode;
 	inode->i_ino = num;
@@ -278,7 +331,7 @@ struct inode* zramfs_get_inode(struct super_block *sb, int mode, dev_t dev)
 		inc_nlink(inode);
 		break;
 	case S_IFLNK:
-		inode->i_op = &page_symlink_inode_operations;
+		inode->i_op = &zramfs_symlink_inode_operations;
 		break;
 	}
 	printk(KERN_NOTICE "***zramfs_get_inode, inode:%ld, drity:%ld\n",  inode->i_ino, inode->i_state & I_DIRTY );
@@ -298,22 +351,31 @@ struct inode* zramfs_get_inode_byid(struct super_block *sb, int num)
 	int block_size = bdev->bd_block_size;
 	int block_bits = bdev->bd_inode->i_blkbits;
 	
-	//int fs_block_size = sb->s_blocksize;
-	int fs_block_bits = sb->s_blocksize_bits;
-	int begin =  (gzsb->inode_begin << (fs_block_bits - block_bits)) + ((num * INODE_SIZE) >> block_bits);
-	int off = (num * INODE_SIZE) & (block_size - 1);
-	struct gza_inode *ginode = kzalloc(sizeof(struct gza_inode), GFP_KERNEL);
+	loff_t offset;
+	sector_t begin;
+	int off;
+	struct zramfs_inode_info *info = NULL;
+	struct gza_inode *ginode = NULL;
 	umode_t mode = 0;	
 	struct buffer_head *bh = NULL;
 	void *cur = NULL;
 	void *mapAddr = NULL;
 	
-	if (!num)
+	if (!num || num >= gzsb->inode_num)
 		return NULL;
+	offset = zramfs_inode_offset(sb, num);
+	begin = offset >> block_bits;
+	off = offset & (block_size - 1);
 
+	info = zramfs_alloc_info();
+	if (!info)
+		return NULL;
+	ginode = &info->ginode;
 	bh = __bread(bdev, begin, block_size);
-	if (!bh)
+	if (!bh) {
+		kfree(info);
 		return NULL;
+	}
 
 	if (PageHighMem(bh->b_page)) {
 		mapAddr = cur = kmap_atomic(bh->b_page, KM_USER0);
@@ -323,7 +385,8 @@ struct inode* zramfs_get_inode_byid(struct super_block *sb, int num)
 		cur = bh->b_data + off;
 	}
 	
-	memcpy(ginode, cur, sizeof(struct gza_inode));
+	//a version 1 inode leaves the rest zero
+	memcpy(ginode, cur, zramfs_inode_size(gzsb));
 		
 	if (PageHighMem(bh->b_page))
 		kunmap_atomic(mapAddr, KM_USER0);
@@ -335,6 +398,7 @@ struct inode* zramfs_get_inode_byid(struct super_block *sb, int num)
 	// param require unsign long
 	inode = iget_locked(sb, num);
 	if ((inode->i_state & I_NEW) != I_NEW) {
+		kfree(info);
 		return inode;
 	}
 	inode->i_size = (loff_t)ginode->length;
@@ -350,6 +414,17 @@ struct inode* zramfs_get_inode_byid(struct super_block *sb, int num)
 	mapping_set_gfp_mask(inode->i_mapping, GFP_HIGHUSER);
 	//mapping_set_unevictable(inode->i_mapping);
 	inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+	if (zramfs_inode_size(gzsb) >= INODE_SIZE_V2) {
+		inode->i_size = ((loff_t)ginode->size_high << 32) | (u32)ginode->length;
+		inode->i_uid = ginode->uid;
+		inode->i_gid = ginode->gid;
+		inode->i_atime.tv_sec = ginode->atime;
+		inode->i_atime.tv_nsec = ginode->atime_nsec;
+		inode->i_mtime.tv_sec = ginode->mtime;
+		inode->i_mtime.tv_nsec = ginode->mtime_nsec;
+		inode->i_ctime.tv_sec = ginode->ctime;
+		inode->i_ctime.tv_nsec = ginode->ctime_nsec;
+	}
 	switch (mode & S_IFMT) {
 	default:
 		init_special_inode(inode, mode, ginode->dev);
@@ -367,9 +442,15 @@ struct inode* zramfs_get_inode_byid(struct super_block *sb, int num)
 		inc_nlink(inode);
 		break;
 	case S_IFLNK:
-		inode->i_op = &page_symlink_inode_operations;
+		if (ginode->flags & ZRAMFS_INODE_INLINE)
+			inode->i_op = &zramfs_fast_symlink_inode_operations;
+		else
+			inode->i_op = &zramfs_symlink_inode_operations;
 		break;
 	}
+	//version 1 has no link count, files have one link and directories two
+	if (ginode->nlink)
+		inode->i_nlink = ginode->nlink;
 	//add inode cache -- new_inode
 	//insert_inode_locked(inode);
 	unlock_new_inode(inode);
@@ -379,9 +460,15 @@ struct inode* zramfs_get_inode_byid(struct super_block *sb, int num)
 
 int zramfs_mknod(struct inode* dir, struct dentry *dentry, int mode, dev_t dev)
 {
-	struct inode* inode = zramfs_get_inode(dir->i_sb, mode, dev);
+	struct inode* inode = zramfs_get_inode(dir->i_sb, dir, mode, dev);
 	int error = -ENOSPC;
 	if (inode) {
+		error = zramfs_init_security(inode, dir);
+		if (error) {
+			clear_nlink(inode);
+			iput(inode);
+			return error;
+		}
 		if (dir->i_mode & S_ISGID) {
 			inode->i_gid |= dir->i_gid;
 			if (S_ISDIR(mode)) {
@@ -391,6 +478,8 @@ int zramfs_mknod(struct inode* dir, struct dentry *dentry, int mode, dev_t dev)
 		d_instantiate(dentry, inode);
 		error = 0;
 		dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+		mark_inode_dirty(inode);
+		mark_inode_dirty(dir);
 	}
 	return error;
 }
@@ -558,42 +647,321 @@ no_pg_fail:
 }
 */
 
+/*
+ * length of the name of dentry as stored, longer names are cut
+ */
+static int zramfs_name_len(struct dentry *dentry)
+{
+	return dentry->d_name.len > MAX_DIR_NAME ? MAX_DIR_NAME : dentry->d_name.len;
+}
+
 void copy_dentry(struct directory *dty, struct dentry* dentry) 
 {
 	int len;
 	dty->d_status = 1;
 	dty->d_num = dentry->d_inode->i_ino;
-	len = dentry->d_name.len > MAX_DIR_NAME ? MAX_DIR_NAME : dentry->d_name.len;
+	len = zramfs_name_len(dentry);
         memcpy(dty->d_name, dentry->d_name.name, len);
 	dty->d_len = len;
+	dty->d_hash = zramfs_name_hash(dty->d_name, len);
 }
 
-int zramfs_get_data_block(struct super_block * sb) {
-	int begin, end;
-	int block_num = -ENOSPC;
-        struct block_device *bdev = sb->s_bdev;
-	gzafs_sb_info * sbinfo = &((struct ramfs_fs_info*)sb->s_fs_info)->sbinfo;
-	begin = sbinfo->data_bitmap_begin * sbinfo->block_size;
-	end = begin + sbinfo->data_bitmap_block_num * sbinfo->block_size;
-	block_num = find_valid_bit_num(bdev, begin, end);
-	if (block_num) {		
-		return block_num + sbinfo->data_begin;
-	}
-	return -ENOSPC;
+/**
+ * write the in-core super block copy back, synchronously
+ */
+int zramfs_write_sb(struct super_block *sb)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct buffer_head *bh;
+	int err = 0;
+
+	bh = __bread(sb->s_bdev, 0, sb->s_bdev->bd_block_size);
+	if (!bh)
+		return -EIO;
+	memcpy(bh->b_data, &fsi->sbinfo, sizeof(fsi->sbinfo));
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	if (!buffer_uptodate(bh))
+		err = -EIO;
+	brelse(bh);
+	return err;
 }
 
-int zramfs_get_valid_diretory(struct inode * inode, struct dentry *dentry)
+/**
+ * record an incompat feature the first time the module uses it on the
+ * volume. a revision 0 volume first gets the feature words its layout
+ * implies.
+ */
+int zramfs_set_feature_incompat(struct super_block *sb, u32 feature)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	gzafs_sb_info old;
+	int dirty = 0, err = 0;
+
+	if (sbinfo->rev_level != ZRAMFS_REV_ORIG && (sbinfo->feature_incompat & feature))
+		return 0;
+	//resize and the orphan list change the super block under it too
+	mutex_lock(&fsi->orphan_lock);
+	old = *sbinfo;
+	if (sbinfo->rev_level == ZRAMFS_REV_ORIG) {
+		sbinfo->feature_compat = 0;
+		sbinfo->feature_incompat = 0;
+		sbinfo->feature_ro_compat = 0;
+		if (zramfs_inode_size(sbinfo) == INODE_SIZE_V2) {
+			sbinfo->feature_compat |= ZRAMFS_FEATURE_COMPAT_XATTR;
+			sbinfo->feature_incompat |= ZRAMFS_FEATURE_INCOMPAT_INODE_V2;
+		}
+		if (sbinfo->block_num > 0x7fffffffU)
+			sbinfo->feature_incompat |= ZRAMFS_FEATURE_INCOMPAT_BLOCKS32;
+		sbinfo->rev_level = ZRAMFS_REV_FEATURES;
+		dirty = 1;
+	}
+	if (!(sbinfo->feature_incompat & feature)) {
+		sbinfo->feature_incompat |= feature;
+		dirty = 1;
+	}
+	if (dirty) {
+		err = zramfs_write_sb(sb);
+		printk(KERN_NOTICE "zramfs: %s, features now %x/%x/%x, err:%d\n", sb->s_id,
+				sbinfo->feature_compat, sbinfo->feature_incompat, sbinfo->feature_ro_compat, err);
+		//not on disk, so nothing may depend on it yet
+		if (err) {
+			sbinfo->rev_level = old.rev_level;
+			sbinfo->feature_compat = old.feature_compat;
+			sbinfo->feature_incompat = old.feature_incompat;
+			sbinfo->feature_ro_compat = old.feature_ro_compat;
+		}
+	}
+	mutex_unlock(&fsi->orphan_lock);
+	return err;
+}
+
+/**
+ * point the on-disk next_orphan of inode ino at next, synchronously.
+ * zramfs_write_inode never touches that field, so this is its only writer.
+ */
+static int zramfs_set_orphan_link(struct super_block *sb, u32 ino, u32 next)
 {
+	struct block_device *bdev = sb->s_bdev;
+	loff_t offset = zramfs_inode_offset(sb, ino) + offsetof(struct gza_inode, next_orphan);
+	struct buffer_head *bh;
+	int err = 0;
+
+	bh = __bread(bdev, offset >> bdev->bd_inode->i_blkbits, bdev->bd_block_size);
+	if (!bh)
+		return -EIO;
+	*(u32 *)(bh->b_data + (offset & (bdev->bd_block_size - 1))) = next;
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	if (!buffer_uptodate(bh))
+		err = -EIO;
+	brelse(bh);
+	return err;
+}
+
+int zramfs_write_inode(struct inode * inode, int do_sync);
+
+/**
+ * put an inode that lost its last link on the on-disk orphan list, so its
+ * space is found again at mount if we crash before the final free.
+ */
+static void zramfs_orphan_add(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_inode_info *info = ZRAMFS_I(inode);
+
+	mutex_lock(&fsi->orphan_lock);
+	if (!list_empty(&info->orphan))
+		goto out;
+	//block map and link have to be on disk before the head points here
+	zramfs_write_inode(inode, 1);
+	info->ginode.next_orphan = fsi->sbinfo.orphan_head;
+	zramfs_set_orphan_link(sb, inode->i_ino, info->ginode.next_orphan);
+	fsi->sbinfo.orphan_head = inode->i_ino;
+	zramfs_write_sb(sb);
+	list_add(&info->orphan, &fsi->orphan_list);
+ 	printk(KERN_NOTICE "*** zramfs_orphan_add:%ld, next:%d\n", inode->i_ino, info->ginode.next_orphan);	
+out:
+	mutex_unlock(&fsi->orphan_lock);
+}
+
+static void zramfs_orphan_del(struct super_block *sb, struct zramfs_inode_info *info)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_inode_info *prev;
+
+	mutex_lock(&fsi->orphan_lock);
+	if (list_empty(&info->orphan))
+		goto out;
+	if (fsi->orphan_list.next == &info->orphan) {
+		fsi->sbinfo.orphan_head = info->ginode.next_orphan;
+		zramfs_write_sb(sb);
+	} else {
+		prev = list_entry(info->orphan.prev, struct zramfs_inode_info, orphan);
+		prev->ginode.next_orphan = info->ginode.next_orphan;
+		zramfs_set_orphan_link(sb, prev->ginode.num, prev->ginode.next_orphan);
+	}
+	list_del_init(&info->orphan);
+out:
+	mutex_unlock(&fsi->orphan_lock);
+}
 
+/**
+ * nlink just dropped to zero. an inode nobody else holds is deleted right
+ * away by the final iput, only one that stays open goes on the orphan list.
+ * icount and dcount are the references the vfs holds itself while it calls
+ * us: the dentry's and do_unlinkat's on the inode, lookup's and
+ * dentry_unhash's (directories only) on the dentry.
+ */
+static void zramfs_maybe_orphan(struct inode *inode, struct dentry *dentry, int icount, int dcount)
+{
+	if (inode->i_nlink)
+		return;
+	if (atomic_read(&dentry->d_count) > dcount || atomic_read(&inode->i_count) > icount)
+		zramfs_orphan_add(inode);
+}
+
+/**
+ * free the data and the inode bit of orphans left by a crash
+ */
+static void zramfs_orphan_cleanup(struct super_block *sb)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	u32 ino = sbinfo->orphan_head;
+	unsigned int blocks[INODE_DATA_COUNT];
+	struct gza_inode ginode;
+	int nr = 0;
+	int count;
+	int i;
+
+	if (sb->s_flags & MS_RDONLY) {
+		printk(KERN_NOTICE "zramfs: read-only mount, orphans left for a rw mount\n");
+		return;
+	}
+	while (ino) {
+		if (ino <= ROOT_INODE_NUM || ino >= sbinfo->inode_num || nr++ >= sbinfo->inode_num) {
+			printk(KERN_ERR "zramfs: bad orphan inode %d, list dropped\n", ino);
+			break;
+		}
+		memset(&ginode, 0, sizeof(ginode));
+		get_dev_content(sb->s_bdev, zramfs_inode_offset(sb, ino), (char *)&ginode,
+				zramfs_inode_size(sbinfo));
+		count = 0;
+		for (i = 0; i < INODE_DATA_COUNT && !(ginode.flags & ZRAMFS_INODE_INLINE); i++) {
+			if (ginode.data[i])
+				blocks[count++] = ginode.data[i];
+		}
+		zramfs_free_data_blocks(sb, blocks, count);
+		zramfs_xattr_release(sb, ginode.xattr_block);
+		zramfs_free_inode_num(sb, ino, S_ISDIR(ginode.mode));
+ 		printk(KERN_NOTICE "zramfs: orphan inode %d freed, %d blocks\n", ino, count);	
+		ino = ginode.next_orphan;
+	}
+	sbinfo->orphan_head = 0;
+	zramfs_write_sb(sb);
+}
+
+/**
+ * the last steps of deleting an inode: off the orphan list, then the bit.
+ * the cleared data bits of an orphan reach the disk before the list entry
+ * goes, or a crash in between loses the blocks.
+ */
+static void zramfs_free_inode_info(struct super_block *sb, struct zramfs_inode_info *info)
+{
+	//data[] still holds the block map, the freed arrays are rebased by now
+	if (!list_empty(&info->orphan) && !(info->ginode.flags & ZRAMFS_INODE_INLINE))
+		zramfs_sync_block_bitmaps(sb, info->ginode.data, INODE_DATA_COUNT);
+	zramfs_orphan_del(sb, info);
+	zramfs_free_inode_num(sb, info->ginode.num, S_ISDIR(info->ginode.mode));
+	kfree(info);
+}
+
+static void zramfs_free_worker(struct work_struct *work)
+{
+	struct ramfs_fs_info *fsi = container_of(work, struct ramfs_fs_info, free_work);
+	struct zramfs_free_work *fw;
+
+	spin_lock(&fsi->free_lock);
+	while (!list_empty(&fsi->free_list)) {
+		fw = list_first_entry(&fsi->free_list, struct zramfs_free_work, list);
+		list_del(&fw->list);
+		spin_unlock(&fsi->free_lock);
+
+		zramfs_free_data_blocks(fsi->sb, fw->blocks, fw->count);
+		if (fw->info)
+			zramfs_free_inode_info(fsi->sb, fw->info);
+		kfree(fw);
+
+		spin_lock(&fsi->free_lock);
+	}
+	spin_unlock(&fsi->free_lock);
+}
+
+/**
+ * free the blocks taken off an inode by truncate or delete, then the
+ * deleted inode itself if info is set. with the async_free mount option,
+ * batches of at least async_free blocks are left to the worker.
+ */
+void zramfs_release_blocks(struct super_block *sb, unsigned int *blocks, int count, struct zramfs_inode_info *info)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_free_work *fw;
+
+	if (fsi->mount_opts.async_free && count >= fsi->mount_opts.async_free) {
+		fw = kmalloc(sizeof(*fw), GFP_NOFS);
+		if (fw) {
+			memcpy(fw->blocks, blocks, count * sizeof(*blocks));
+			fw->count = count;
+			fw->info = info;
+			spin_lock(&fsi->free_lock);
+			list_add_tail(&fw->list, &fsi->free_list);
+			spin_unlock(&fsi->free_lock);
+			queue_work(zramfs_wq, &fsi->free_work);
+			return;
+		}
+	}
+	zramfs_free_data_blocks(sb, blocks, count);
+	if (info)
+		zramfs_free_inode_info(sb, info);
+}
+
+/*
+ * data of a directory buffer, mapped for a short access that doesn't sleep
+ */
+static void *zramfs_kmap_bh(struct buffer_head *bh)
+{
+	if (PageHighMem(bh->b_page))
+		return kmap_atomic(bh->b_page, KM_USER0) + bh_offset(bh);
+	return bh->b_data;
+}
+
+static void zramfs_kunmap_bh(struct buffer_head *bh, void *addr)
+{
+	if (PageHighMem(bh->b_page))
+		kunmap_atomic(addr, KM_USER0);
+}
+
+/*
+ * add an entry for dentry to inode, a directory. slots are claimed under
+ * the buffer lock of their block with dir_sem shared, only adding a block
+ * to the directory takes dir_sem exclusive. the search starts at the free
+ * slot hint, the slots before it are all taken.
+ */
+int zramfs_get_valid_diretory(struct inode * inode, struct dentry *dentry)
+{
+	struct zramfs_inode_info *info = ZRAMFS_I(inode);
 	struct gza_inode *ginode = inode->i_private;
 	struct block_device *bdev = inode->i_sb->s_bdev;
 	int blk_blocksize = bdev->bd_block_size;
 	int blk_blockbits = blksize_bits(blk_blocksize);
-	int dev_block = 0;
+	sector_t dev_block = 0;
 
 	int cur_block = 0;
 	int last_block = MAX_FILE_BLOCK_NUM;
-	int file_block = 0;
+	u32 file_block = 0;
 	int block_bits = inode->i_blkbits;
 	int num = 1 << (block_bits - blk_blockbits);
 	struct buffer_head *bh;
@@ -601,60 +969,94 @@ int zramfs_get_valid_diretory(struct inode * inode, struct dentry *dentry)
 
 	void * dty;
 	void * cur;
-	void * mapAddr;
-	int dic_num = -1;
-	int err = -ENOSPC;
+	u32 hint;
+	int skip;
+	u32 pos;
+	int err = -EAGAIN;
+
+	if (zramfs_inline(inode)) {
+		down_write(&info->dir_sem);
+		if (zramfs_inline(inode)) {
+			err = zramfs_inline_dir_add(inode, dentry->d_name.name, zramfs_name_len(dentry),
+					dentry->d_inode->i_ino);
+			//full, it goes to blocks and the entry with it
+			if (err == -ENOSPC) {
+				err = zramfs_inline_dir_convert(inode);
+				if (!err)
+					err = -EAGAIN;
+			}
+		}
+		up_write(&info->dir_sem);
+		if (err != -EAGAIN)
+			return err;
+	}
+	err = -ENOSPC;
+	hint = info->free_hint;
+	down_read(&info->dir_sem);
+	zramfs_dir_readahead(inode, hint);
+	cur_block = hint >> block_bits;
 	while (cur_block < last_block) {
 		printk(KERN_NOTICE "zramfs_get_valid_directory, inode:%ld, file block index:%d, file block:%d\n", inode->i_ino, cur_block, ginode->data[cur_block]);
 		if (ginode->data[cur_block]) {
 			file_block = ginode->data[cur_block];
-			dev_block = file_block << (block_bits - blk_blockbits);
+			dev_block = (sector_t)file_block << (block_bits - blk_blockbits);
 			num = 1 << (block_bits - blk_blockbits);
+			//the first block is entered at the hint
+			skip = (hint & ((1 << block_bits) - 1)) >> blk_blockbits;
+			dev_block += skip;
+			num -= skip;
 			while (--num >= 0) {
-				mapAddr = 0;
 				bh = __bread(bdev, dev_block, blk_blocksize);
-				if (PageHighMem(bh->b_page)) {
-					mapAddr = cur = kmap_atomic(bh->b_page, KM_USER0);
-					cur +=  (int)bh->b_data;
-				} else {
-					cur = bh->b_data;
+				if (!bh) {
+					err = -EIO;
+					goto out;
 				}
-				dty = cur;
+				lock_buffer(bh);
+				cur = zramfs_kmap_bh(bh);
+				dty = cur + (hint & (blk_blocksize - 1));
+				hint = 0;
 				while(dty < cur + blk_blocksize &&
 						((struct directory *)dty)->d_status) {
 					dty += DIRECTORY_SIZE;
-					dic_num++;
 				}
 				if (dty < cur + blk_blocksize ) {
 					copy_dentry((struct directory*) dty, dentry);
+					pos = (cur_block << block_bits) +
+						((dev_block - ((sector_t)file_block << (block_bits - blk_blockbits))) << blk_blockbits) +
+						(dty - cur);
+					zramfs_kunmap_bh(bh, cur);
+					unlock_buffer(bh);
 					mark_buffer_dirty(bh);
 					// dirty inode
 					mark_inode_dirty(inode);
 					put_bh(bh);
-					
-					//unmap	
-					if (mapAddr) {
-						kunmap_atomic(mapAddr, KM_USER0);
-					}
-					return 0;	
-				}
-				//unmap
-				if (mapAddr) {
-					kunmap_atomic(mapAddr, KM_USER0);
+					zramfs_index_add(inode, dentry->d_name.name, zramfs_name_len(dentry),
+							dentry->d_inode->i_ino, pos);
+					info->free_hint = pos + DIRECTORY_SIZE;
+					err = 0;
+					goto out;
 				}
+				zramfs_kunmap_bh(bh, cur);
+				unlock_buffer(bh);
 				put_bh(bh);
 				dev_block++;
 	
 			}		
-
+			hint = 0;
 			cur_block++;
 		} else {
-			// alloc new block  
-			file_block = zramfs_get_data_block(inode->i_sb);
-			printk(KERN_NOTICE "zramfs_get_valid_directory, inode:%ld,  file block index:%d,  alloc file block:%d\n",inode->i_ino, cur_block, file_block);
-			if (file_block > 0) {
+			//readers walk data[], a new block goes in with them kept out
+			up_read(&info->dir_sem);
+			down_write(&info->dir_sem);
+			file_block = 0;
+			if (!ginode->data[cur_block]) {
+				// alloc new block  
+				file_block = zramfs_get_data_block(inode, cur_block);
+				printk(KERN_NOTICE "zramfs_get_valid_directory, inode:%ld,  file block index:%d,  alloc file block:%u\n",inode->i_ino, cur_block, file_block);
+			}
+			if (file_block) {
 				//clear content
-				dev_block = file_block << (block_bits - blk_blockbits);	
+				dev_block = (sector_t)file_block << (block_bits - blk_blockbits);	
 				num = 1 << (block_bits - blk_blockbits);
 				while(--num >= 0) {
 					clear_bdev_block_content(bdev, dev_block, blk_blocksize);
@@ -662,12 +1064,15 @@ int zramfs_get_valid_diretory(struct inode * inode, struct dentry *dentry)
 				}
 				ginode->data[cur_block] = file_block;
 				mark_inode_dirty(inode);
-				continue;
 			}
-			return file_block;			
+			downgrade_write(&info->dir_sem);
+			//no free block, err is still -ENOSPC
+			if (!ginode->data[cur_block])
+				goto out;
 		}	
 	}
-
+out:
+	up_read(&info->dir_sem);
 	return err;
 }
 
@@ -684,11 +1089,11 @@ static int zramfs_dir_empty(struct dentry * dentry)
 	struct block_device *bdev = inode->i_sb->s_bdev;
 	int blk_blocksize = bdev->bd_block_size;
 	int blk_blockbits = blksize_bits(blk_blocksize);
-	int dev_block = 0;
+	sector_t dev_block = 0;
 
 	int cur_block = 0;
 	int last_block = MAX_FILE_BLOCK_NUM;
-	int file_block = 0;
+	u32 file_block = 0;
 	int block_bits = inode->i_blkbits;
 	int num = 1 << (block_bits - blk_blockbits);
 	struct buffer_head *bh;
@@ -696,31 +1101,32 @@ static int zramfs_dir_empty(struct dentry * dentry)
 
 	void * dty;
 	void * cur;
-	void * kmap_addr = 0;
+	down_read(&ZRAMFS_I(inode)->dir_sem);
+	if (zramfs_inline(inode)) {
+		ret = zramfs_inline_dir_empty(inode);
+		goto out;
+	}
+	zramfs_dir_readahead(inode, 0);
 	while (cur_block < last_block) {
 		if (ginode->data[cur_block]) {
 			file_block = ginode->data[cur_block];
-			dev_block = file_block << (block_bits - blk_blockbits);
+			dev_block = (sector_t)file_block << (block_bits - blk_blockbits);
 			num = 1 << (block_bits - blk_blockbits);
 			while (--num >= 0) {
 				bh = __bread(bdev, dev_block, blk_blocksize);
-				kmap_addr = 0;
-				if (PageHighMem(bh->b_page)) {
-					kmap_addr = kmap_atomic(bh->b_page, KM_USER0);
-					cur = kmap_addr + (int)bh->b_data;
-				} else {
-					cur = bh->b_data;
+				if (!bh) {
+					ret = 0;
+					goto out;
 				}
+				cur = zramfs_kmap_bh(bh);
 				dty = cur;
 				while(dty < cur + blk_blocksize &&
 						!((struct directory *)dty)->d_status) {
 					dty += DIRECTORY_SIZE;
 				}
+				zramfs_kunmap_bh(bh, cur);
 				put_bh(bh);
 				dev_block++;
-				if (kmap_addr) {
-					kunmap_atomic(kmap_addr, KM_USER0);
-				}
 				if (dty < cur + blk_blocksize) {
 					ret = 0;
 					goto out;
@@ -735,65 +1141,70 @@ static int zramfs_dir_empty(struct dentry * dentry)
 
 	}
 out:
+	up_read(&ZRAMFS_I(inode)->dir_sem);
 	return ret;
 
 }
 
 /**
- * lookup a dentry
+ * lookup a dentry, with dir_sem of inode held. returns the offset of the
+ * entry in *bhp, which the caller puts, or -ENOENT.
  */
-void zramfs_find_diretory(struct inode * inode, struct dentry *dentry, struct buffer_head **bhp, struct directory **fentry, void ** kmapAddr)
+int zramfs_find_diretory(struct inode * inode, struct dentry *dentry, struct buffer_head **bhp)
 {
 
 	struct gza_inode *ginode = inode->i_private;
 	struct block_device *bdev = inode->i_sb->s_bdev;
 	int blk_blocksize = bdev->bd_block_size;
 	int blk_blockbits = blksize_bits(blk_blocksize);
-	int dev_block = 0;
+	sector_t dev_block = 0;
 
 	int cur_block = 0;
 	int last_block = MAX_FILE_BLOCK_NUM;
-	int file_block = 0;
+	u32 file_block = 0;
 	int block_bits = inode->i_blkbits;
 	int num;
 	struct buffer_head *bh;
+	int len = zramfs_name_len(dentry);
+	u32 hash = zramfs_name_hash(dentry->d_name.name, len);
+	struct directory *de;
 
 
 	void * dty;
 	void * cur;
+	int offset;
+	zramfs_dir_readahead(inode, 0);
 	//TODO: last_block must is file size
 	while (cur_block < last_block) {
 		if (ginode->data[cur_block]) {
 			file_block = ginode->data[cur_block];
-			dev_block = file_block << (block_bits - blk_blockbits);
+			dev_block = (sector_t)file_block << (block_bits - blk_blockbits);
 			num = 1 << (block_bits - blk_blockbits);
 			while (--num >= 0) {
-				*kmapAddr = 0;
 				bh = __bread(bdev, dev_block, blk_blocksize);
-				if (PageHighMem(bh->b_page)) {
-					*kmapAddr = cur = kmap_atomic(bh->b_page, KM_USER0);
-					cur +=  (int)bh->b_data;
-				} else {
-					cur = bh->b_data;
-				}
+				if (!bh)
+					return -EIO;
+				cur = zramfs_kmap_bh(bh);
 				dty = cur;
 				while(dty < cur + blk_blocksize) {
-					if (!((struct directory *)dty)->d_status) {
+					de = dty;
+					//hash and length first, bytes only for a likely match
+					if (!de->d_status || (de->d_hash && de->d_hash != hash) ||
+							de->d_len != len) {
 						dty += DIRECTORY_SIZE;
 						continue;	
 					}
-					if (!memcmp(dentry->d_name.name, ((struct directory *)dty)->d_name, dentry->d_name.len)) {
+					if (!memcmp(dentry->d_name.name, de->d_name, len)) {
 						//find entry 
 						printk(KERN_NOTICE "zramfs_find_directory, find entry name:%s", dentry->d_name.name);
+						offset = dty - cur;
+						zramfs_kunmap_bh(bh, cur);
 						*bhp = bh;
-						*fentry = dty;
-						return;
+						return offset;
 					}
 					dty += DIRECTORY_SIZE;
 				}
-				if (*kmapAddr) {
-					kunmap_atomic(*kmapAddr, KM_USER0);
-				}
+				zramfs_kunmap_bh(bh, cur);
 				put_bh(bh);
 				dev_block++;
 	
@@ -804,39 +1215,113 @@ void zramfs_find_diretory(struct inode * inode, struct dentry *dentry, struct bu
 			break;
 		}	
 	}
+	return -ENOENT;
+}
 
+/*
+ * clear the entry of dentry in dir, or point it at inode ino if ino is set.
+ * the entry itself can't change under us, the VFS holds the i_mutex of
+ * both, the buffer lock only keeps inserts into its block out.
+ */
+static int zramfs_update_entry(struct inode *dir, struct dentry *dentry, int ino)
+{
+	struct zramfs_inode_info *info = ZRAMFS_I(dir);
+	int len = zramfs_name_len(dentry);
+	struct buffer_head *bh = NULL;
+	struct directory *fentry;
+	u32 inum, pos;
+	void *cur;
+	int offset;
+	int res;
+
+	if (zramfs_inline(dir)) {
+		down_write(&info->dir_sem);
+		res = -EAGAIN;
+		if (zramfs_inline(dir))
+			res = zramfs_inline_dir_set(dir, dentry->d_name.name, len, ino);
+		up_write(&info->dir_sem);
+		if (res != -EAGAIN)
+			return res;
+	}
+	down_read(&info->dir_sem);
+	//the index knows where the entry is
+	pos = 0;
+	res = zramfs_index_lookup(dir, dentry->d_name.name, len, &inum, &pos);
+	if (res > 0) {
+		bh = zramfs_dir_bread(dir, pos, &offset);
+		if (!bh)
+			offset = -EIO;
+	} else if (!res) {
+		offset = -ENOENT;
+	} else {
+		offset = zramfs_find_diretory(dir, dentry, &bh);
+	}
+	if (offset >= 0) {
+		lock_buffer(bh);
+		cur = zramfs_kmap_bh(bh);
+		fentry = cur + offset;
+		if (ino)
+			fentry->d_num = ino;
+		else
+			fentry->d_status = 0;
+		zramfs_kunmap_bh(bh, cur);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		put_bh(bh);
+		zramfs_index_update(dir, dentry->d_name.name, len, ino);
+		//without the index the position is unknown, start from the top
+		if (!ino && pos < info->free_hint)
+			info->free_hint = pos;
+	}
+	up_read(&info->dir_sem);
+	return offset < 0 ? offset : 0;
 }
 
 static struct dentry *zramfs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *nd)
 {
 	struct buffer_head* bh = NULL;
         struct directory *fentry = NULL;
-	int inum;
+	int len = zramfs_name_len(dentry);
+	u32 inum = 0;
 	struct inode *inode;
-	void * kmapAddr = NULL;
-	//int err;
-       	zramfs_find_diretory(dir, dentry, &bh, &fentry, &kmapAddr);
+	void *cur;
+	int offset;
+	int res;
+	//err;
+	down_read(&ZRAMFS_I(dir)->dir_sem);
+	//hits and misses alike come from the index once it is built
+	if (zramfs_inline(dir))
+		res = zramfs_inline_dir_find(dir, dentry->d_name.name, len, &inum) >= 0;
+	else
+		res = zramfs_index_lookup(dir, dentry->d_name.name, len, &inum, NULL);
+	if (res < 0 && !zramfs_index_build(dir))
+		res = zramfs_index_lookup(dir, dentry->d_name.name, len, &inum, NULL);
+	if (res < 0) {
+		offset = zramfs_find_diretory(dir, dentry, &bh);
+		res = 0;
+		if (offset >= 0) {
+			cur = zramfs_kmap_bh(bh);
+			fentry = cur + offset;
+			inum = fentry->d_num;
+			zramfs_kunmap_bh(bh, cur);
+			put_bh(bh);
+			res = 1;
+		}
+	}
+	up_read(&ZRAMFS_I(dir)->dir_sem);
 	printk(KERN_NOTICE "zramfs_lookup, find dentry name:%s", dentry->d_name.name);
-	if (!fentry)
+	if (!res)
 		goto not_find;
-	printk(KERN_NOTICE "zramfs_lookup, find bh:%p, fentry:%p", bh, fentry);
-	inum = fentry->d_num;
-	put_bh(bh);
-	if (kmapAddr) {
-		kunmap_atomic(kmapAddr, KM_USER0);
-	}
 	
 	printk(KERN_NOTICE "zramfs_lookup, find parent inode:%ld", dir->i_ino);
 	printk(KERN_NOTICE "zramfs_lookup, find entry name:%s", dentry->d_name.name);
-	printk(KERN_NOTICE "zramfs_lookup, find entry:%p", fentry);
-	printk(KERN_NOTICE "zramfs_lookup, find entry inode num:%d", fentry->d_num);
+	printk(KERN_NOTICE "zramfs_lookup, find entry inode num:%d", inum);
 	//lookup from inode cache
 	inode = ilookup(dir->i_sb, inum);
 	if (inode)
 		goto find;
 	//lookup from disk 	
-	inode = zramfs_get_inode_byid(dir->i_sb, fentry->d_num);
-	printk(KERN_NOTICE "zramfs_lookup,  find inode byid inode:%p, inode->num:%ld", inode, inode->i_ino);
+	inode = zramfs_get_inode_byid(dir->i_sb, inum);
 	if (inode)
 		goto find;
 not_find:
@@ -844,6 +1329,7 @@ not_find:
 	d_add(dentry, NULL);
 	return NULL;
 find:
+	printk(KERN_NOTICE "zramfs_lookup,  find inode:%p, inode->num:%ld", inode, inode->i_ino);
 	d_add(dentry, inode);
 	return NULL;
 }
@@ -946,6 +1432,7 @@ int zramfs_mkdir(struct inode* dir, struct dentry * dentry, int mode)
 	
 	if (!err) {
 		inc_nlink(dir);
+		mark_inode_dirty(dir);
 	}	
 	return err;
 }
@@ -974,7 +1461,7 @@ static int zramfs_symlink(struct inode * dir, struct dentry *dentry, const char
 	struct inode *inode;
 	int error = -ENOSPC;
 
-	inode = zramfs_get_inode(dir->i_sb, S_IFLNK|S_IRWXUGO, 0);
+	inode = zramfs_get_inode(dir->i_sb, dir, S_IFLNK|S_IRWXUGO, 0);
 	if (!inode) {
 		printk(KERN_NOTICE"zramfs_symlink, zramfs_get_inode can't get inode, err code:%d", error);
 		return error;
@@ -982,7 +1469,24 @@ static int zramfs_symlink(struct inode * dir, struct dentry *dentry, const char
 
 	if (inode) {
 		int l = strlen(symname)+1;
-		error = page_symlink(inode, symname, l);
+		struct gza_inode *ginode = inode->i_private;
+		error = zramfs_init_security(inode, dir);
+		if (error) {
+			clear_nlink(inode);
+			iput(inode);
+			return error;
+		}
+		if (l <= ZRAMFS_INLINE_SIZE &&
+				!zramfs_set_feature_incompat(dir->i_sb, ZRAMFS_FEATURE_INCOMPAT_INLINE_DATA)) {
+			memcpy(ginode->data, symname, l);
+			ginode->flags |= ZRAMFS_INODE_INLINE;
+			inode->i_op = &zramfs_fast_symlink_inode_operations;
+			inode->i_size = l - 1;
+			mark_inode_dirty(inode);
+			error = 0;
+		} else {
+			error = page_symlink(inode, symname, l);
+		}
 		if (!error) {
 			if (dir->i_mode & S_ISGID)
 				inode->i_gid = dir->i_gid;
@@ -1006,53 +1510,79 @@ void zramfs_delete_inode(struct inode * inode)
 {	
 	//del from filesystem, trancate the file mapping
 	struct gza_inode * ginode = (struct gza_inode*)inode->i_private;
-	gzafs_sb_info *sbinfo = &((struct ramfs_fs_info *)inode->i_sb->s_fs_info)->sbinfo;
-	int num= 0;
-	int index=0;
-	int bitoffset = 0;
-	u32 offset = 0;
+	struct ramfs_fs_info *fsi = inode->i_sb->s_fs_info;
+	unsigned int blocks[INODE_DATA_COUNT];
+	u32 xattr_block;
+	int count = 0;
 	int i = 0;
 	//truncate page cache
 	truncate_inode_pages(&inode->i_data,0);
-	clear_inode(inode);
-	if (!ginode)
+	if (!ginode) {
+		clear_inode(inode);
 		return;
-	//trucate data
-	for (;i<INODE_DATA_COUNT;i++)
+	}
+	//trucate data, preallocated blocks included. inline data is no block
+	for (; i < INODE_DATA_COUNT && !(ginode->flags & ZRAMFS_INODE_INLINE); i++)
 	{
 		if (ginode->data[i] == 0)
 			continue;
-		num = ginode->data[i];
-		index = num >> 3;
-		bitoffset = num & 0x07;
-		offset = (int)(sbinfo->data_bitmap_begin * sbinfo->block_size + index);
-		set_dev_bit(inode->i_sb->s_bdev, offset, bitoffset, UNSET);
-	
- 		printk(KERN_NOTICE "*** zramfs_delete_inode clear data block num:%d\n", num);	
+		blocks[count++] = ginode->data[i];
+ 		printk(KERN_NOTICE "*** zramfs_delete_inode clear data block num:%d\n", ginode->data[i]);	
 	}
-	//clean inode bitmap
-	index = ginode->num >> 3;
-	offset = sbinfo->inode_bitmap_begin * sbinfo->block_size + index;
-	bitoffset = ginode->num & 0x07;
-	set_dev_bit(inode->i_sb->s_bdev, offset, bitoffset, UNSET);
-		
- 	printk(KERN_NOTICE "*** zramfs_delete_inode:%d, offset:%d, bitoffset:%d\n", ginode->num, offset, bitoffset);	
-	
-	kfree(ginode);
+	//shared with other inodes maybe, only its count drops. an orphan
+	//must not point to it any more, or the mount after a crash drops it again
+	xattr_block = ginode->xattr_block;
+	ginode->xattr_block = 0;
+	if (xattr_block && !list_empty(&ZRAMFS_I(inode)->orphan))
+		zramfs_write_inode(inode, 1);
+	zramfs_xattr_release(inode->i_sb, xattr_block);
+	//a deferred free must survive a crash too
+	if (fsi->mount_opts.async_free && count >= fsi->mount_opts.async_free)
+		zramfs_orphan_add(inode);
+	clear_inode(inode);
+ 	printk(KERN_NOTICE "*** zramfs_delete_inode:%d\n", ginode->num);	
+	//data bits first, then the orphan entry and the inode bit
+	zramfs_release_blocks(inode->i_sb, blocks, count, ZRAMFS_I(inode));
 
 }
 
-int  write_inode(struct super_block *sb, struct inode * inode, struct buffer_head** tbh, void **kmapAddr)
+/*
+ * everything but the times of the inode is on disk already. the on-disk
+ * inode is compared, so block map and link changes are never held back.
+ */
+static int zramfs_times_only(struct gza_inode *ginode, struct inode *inode)
+{
+	struct gza_inode *buf_ginode = inode->i_private;
+
+	return ginode->num == inode->i_ino && ginode->mode == inode->i_mode &&
+		ginode->length == (int)inode->i_size &&
+		ginode->size_high == (u32)((u64)inode->i_size >> 32) &&
+		ginode->dev == inode->i_rdev &&
+		ginode->unwritten == buf_ginode->unwritten &&
+		ginode->flags == buf_ginode->flags &&
+		ginode->nlink == inode->i_nlink &&
+		ginode->uid == inode->i_uid && ginode->gid == inode->i_gid &&
+		ginode->xattr_block == buf_ginode->xattr_block &&
+		!memcmp(ginode->data, buf_ginode->data, sizeof(ginode->data)) &&
+		!memcmp(ginode->xattr, buf_ginode->xattr, sizeof(ginode->xattr));
+}
+
+/*
+ * fill the on-disk inode, *tbh is the block to write. with lazy set a
+ * change of only the times is left in memory and 1 returned, *tbh is not
+ * set then.
+ */
+int  write_inode(struct super_block *sb, struct inode * inode, struct buffer_head** tbh, void **kmapAddr, int lazy)
 {
-	gzafs_sb_info * sbinfo = &((struct ramfs_fs_info*)sb->s_fs_info)->sbinfo;
 	struct buffer_head *bh;
-	int ino = inode->i_ino;
-	loff_t index = sbinfo->inode_begin * sbinfo->block_size + ino * INODE_SIZE;
+	loff_t index = zramfs_inode_offset(sb, inode->i_ino);
 	loff_t begin_block = index >> sb->s_bdev->bd_inode->i_blkbits;
 	int offset = index & ((1<<sb->s_bdev->bd_inode->i_blkbits) - 1);
 	char* cur= NULL;
 	struct gza_inode *ginode;
 	struct gza_inode *buf_ginode = (struct gza_inode *)inode->i_private;
+	//the blocks it points to are marked used before it is
+	zramfs_sync_pools(sb);
 	bh = __bread(sb->s_bdev, begin_block, sb->s_bdev->bd_block_size);
 	if (!bh)
 		return -EIO;
@@ -1067,25 +1597,71 @@ int  write_inode(struct super_block *sb, struct inode * inode, struct buffer_hea
 		cur = bh->b_data + offset;
 	}
 	ginode = (struct gza_inode*) cur;
+	if (lazy && zramfs_times_only(ginode, inode)) {
+		brelse(bh);
+		if (*kmapAddr) {
+			kunmap_atomic(*kmapAddr, KM_USER0);
+			*kmapAddr = NULL;
+		}
+		return 1;
+	}
 	ginode->num = inode->i_ino;
 	ginode->mode = inode->i_mode;	
 	ginode->length = inode->i_size;
 	ginode->dev = inode->i_rdev;
+	ginode->unwritten = buf_ginode->unwritten;
+	ginode->flags = buf_ginode->flags;
+	if (zramfs_inode_size(&((struct ramfs_fs_info *)sb->s_fs_info)->sbinfo) >= INODE_SIZE_V2) {
+		ginode->size_high = (u64)inode->i_size >> 32;
+		ginode->nlink = inode->i_nlink;
+		ginode->uid = inode->i_uid;
+		ginode->gid = inode->i_gid;
+		ginode->atime = inode->i_atime.tv_sec;
+		ginode->atime_nsec = inode->i_atime.tv_nsec;
+		ginode->mtime = inode->i_mtime.tv_sec;
+		ginode->mtime_nsec = inode->i_mtime.tv_nsec;
+		ginode->ctime = inode->i_ctime.tv_sec;
+		ginode->ctime_nsec = inode->i_ctime.tv_nsec;
+		ginode->xattr_block = buf_ginode->xattr_block;
+		memcpy(ginode->xattr, buf_ginode->xattr, sizeof(ginode->xattr));
+	}
 	memcpy(ginode->data, buf_ginode->data, sizeof(ginode->data));
  	printk(KERN_NOTICE "*** write inode num:%d, mode:%o\n", ginode->num,ginode->mode);	
 	*tbh = bh;
 	return 0;
 }
 
+/*
+ * lazytime: writeback of an inode whose times alone changed skips the
+ * block and dirties the inode again, so the times go out with the next
+ * real change, a sync, or once they are older than the lazytime age.
+ */
 int zramfs_write_inode(struct inode * inode, int do_sync)
 {
 	struct buffer_head *bh;
 	struct super_block *sb = inode->i_sb;
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_inode_info *info = ZRAMFS_I(inode);
 	void *kmapAddr =  NULL;
-	int err =  write_inode(sb, inode, &bh, &kmapAddr);
+	int lazy = 0;
+	int err;
+
+	if (!do_sync && fsi->mount_opts.lazytime && inode->i_nlink &&
+			zramfs_inode_size(&fsi->sbinfo) >= INODE_SIZE_V2)
+		lazy = !info->time_dirty || time_before(jiffies,
+				info->time_dirty + fsi->mount_opts.lazytime * HZ);
+	err =  write_inode(sb, inode, &bh, &kmapAddr, lazy);
 	printk(KERN_NOTICE "inode->i_sb->s_bdev->bd_disk->queue:%p", inode->i_sb->s_bdev->bd_disk->queue );
+	if (err > 0) {
+		if (!info->time_dirty)
+			info->time_dirty = jiffies ? jiffies : 1;
+		//I_SYNC is set, the writeback puts the inode back on the dirty list
+		mark_inode_dirty_sync(inode);
+		return 0;
+	}
 	if (err)
 		return err;
+	info->time_dirty = 0;
 	mark_buffer_dirty(bh);
 	if (do_sync) {
 		sync_dirty_buffer(bh);
@@ -1117,22 +1693,59 @@ inline unsigned char dt_type(struct inode *inode)
 		return (inode->i_mode >> 12) & 15;
 }
 
+/*
+ * readdir positions: 0 and 1 are . and .., an entry is 2 + its slot number
+ * in the directory. a position stays valid while its entry exists, and
+ * seeking to it costs nothing, readdir computes the slot from it.
+ */
+#define ZRAMFS_DIR_POS_FIRST 2
+
+static loff_t zramfs_dir_pos_end(struct inode *inode)
+{
+	return ZRAMFS_DIR_POS_FIRST + ((loff_t)MAX_FILE_BLOCK_NUM << inode->i_blkbits) / DIRECTORY_SIZE;
+}
+
+static loff_t zramfs_dir_llseek(struct file *filp, loff_t offset, int origin)
+{
+	struct inode *inode = filp->f_path.dentry->d_inode;
+
+	mutex_lock(&inode->i_mutex);
+	switch (origin) {
+	case SEEK_CUR:
+		offset += filp->f_pos;
+	case SEEK_SET:
+		break;
+	default:
+		offset = -EINVAL;
+	}
+	if (offset >= 0 && offset != filp->f_pos) {
+		filp->f_pos = offset;
+		filp->f_version = 0;
+	}
+	mutex_unlock(&inode->i_mutex);
+	return offset < 0 ? -EINVAL : offset;
+}
+
 static int zramfs_readdir(struct file * filp, void * dirent, filldir_t filldir) {
 	struct dentry *dentry = filp->f_path.dentry;
 	ino_t ino;
-	int i = filp->f_pos;
+	int i;
 	int index = 0;
 	int offset = 0;
 	int cur_block = 0;
 	int max_block = MAX_FILE_BLOCK_NUM;
 	struct inode * inode = filp->f_dentry->d_inode;
-	int file_block;
-	int dev_block;
+	u32 file_block;
+	sector_t dev_block;
 	//int dev_blk_num;
 
 	if (!inode) {
 		return 0;
 	}
+	//past the last slot, or a position from an old seek
+	if (filp->f_pos >= zramfs_dir_pos_end(inode))
+		return 0;
+	i = filp->f_pos;
 	printk(KERN_NOTICE "zramfs_readdir, filp->f_pos:%lld", filp->f_pos);
 	switch(i) {
 		case 0:
@@ -1163,19 +1776,29 @@ static int zramfs_readdir(struct file * filp, void * dirent, filldir_t filldir)
 			void * mapAddr=NULL;
 			void * dty;
 			struct directory *tmp_dicp;
-			index = i-2;
-			cur_block = sizeof(struct directory) * index / fs_blocksize;
-			offset  = sizeof(struct directory) * index % fs_blocksize;
+			index = i - ZRAMFS_DIR_POS_FIRST;
+			cur_block = (loff_t)index * DIRECTORY_SIZE / fs_blocksize;
+			offset  = (loff_t)index * DIRECTORY_SIZE % fs_blocksize;
 			cur_dev_block_offset = offset / dev_block_size;
 			offset = offset % dev_block_size;
+			down_read(&ZRAMFS_I(inode)->dir_sem);
+			if (zramfs_inline(inode)) {
+				zramfs_inline_dir_readdir(inode, filp, dirent, filldir, ZRAMFS_DIR_POS_FIRST);
+				goto out;
+			}
+			zramfs_dir_readahead(inode, cur_block << block_bits);
+			//a listing is usually followed by lookups of its names
+			zramfs_index_build(inode);
 			while (cur_block < max_block) {
 				file_block = ginode->data[cur_block];
 				if (file_block) {
-					dev_block = file_block << (block_bits - dev_block_bits);
+					dev_block = (sector_t)file_block << (block_bits - dev_block_bits);
 					dev_block += cur_dev_block_offset;
 					num = dev_blk_num - cur_dev_block_offset;
 					while (--num >= 0) {
 						bh = __bread(bdev, dev_block, dev_block_size);
+						if (!bh)
+							goto out;
 						mapAddr = 0;
 						if (PageHighMem(bh->b_page)) {
 							mapAddr = cur = kmap_atomic(bh->b_page, KM_USER0);
@@ -1196,12 +1819,13 @@ static int zramfs_readdir(struct file * filp, void * dirent, filldir_t filldir)
 							if (filldir(dirent, tmp_dicp->d_name, 
 								tmp_dicp->d_len, 
 								filp->f_pos, 
-								inode->i_ino, 
-								dt_type(inode)) < 0) {
+								tmp_dicp->d_num, 
+								DT_UNKNOWN) < 0) {
 								if (mapAddr) {
 									kunmap_atomic(mapAddr, KM_USER0);
 								}
-								return 0;
+								put_bh(bh);
+								goto out;
 							}
 							printk(KERN_NOTICE "zramfs_readdir, filp->f_pos:%lld, name:%s, inode:%ld", filp->f_pos, tmp_dicp->d_name, inode->i_ino);
 							filp->f_pos++;
@@ -1220,33 +1844,43 @@ static int zramfs_readdir(struct file * filp, void * dirent, filldir_t filldir)
 					break;
 				}
 			}
+out:
+			up_read(&ZRAMFS_I(inode)->dir_sem);
 			} // for static code block
 	}
 	return 0;
 }
 
-static int zramfs_unlink (struct inode *dir,struct dentry * dentry) {
-
+static int __zramfs_unlink(struct inode *dir, struct dentry *dentry)
+{
 	struct inode *inode = dentry->d_inode;
-	struct buffer_head* bh = NULL;
-        struct directory *fentry = NULL;
-	void *kmapAddr = NULL;
-
-	inode->i_ctime = dir->i_ctime = dir->i_mtime = CURRENT_TIME;
-	drop_nlink(inode);
+	int err;
 
 	//clear parent dentry
-       	zramfs_find_diretory(dir, dentry, &bh, &fentry, &kmapAddr); //debug
-	fentry->d_status = 0;
-	put_bh(bh);	
-	if (kmapAddr) {
-		kunmap_atomic(kmapAddr, KM_USER0);
+	err = zramfs_update_entry(dir, dentry, 0);
+	if (err) {
+		printk(KERN_ERR"zramfs_unlink, not find the dentry, err:%d", err);
+		return err == -ENOENT ? -EIO : err;
 	}
+	inode->i_ctime = dir->i_ctime = dir->i_mtime = CURRENT_TIME;
+	drop_nlink(inode);
+	mark_inode_dirty(inode);
+	mark_inode_dirty(dir);
 	return 0;
 }
 
+static int zramfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	int err = __zramfs_unlink(dir, dentry);
+
+	if (!err)
+		zramfs_maybe_orphan(dentry->d_inode, dentry, 2, 1);
+	return err;
+}
+
 static int zramfs_rmdir(struct inode* dir, struct dentry *dentry){
-	
+	int err;
+
 	if (!dentry->d_inode) {
 		return 0;
 	}
@@ -1256,51 +1890,64 @@ static int zramfs_rmdir(struct inode* dir, struct dentry *dentry){
 	}
  
 	drop_nlink(dentry->d_inode);
-	zramfs_unlink(dir, dentry);
+	err = __zramfs_unlink(dir, dentry);
+	if (err) {
+		inc_nlink(dentry->d_inode);
+		return err;
+	}
 	drop_nlink(dir);	
+	mark_inode_dirty(dir);
+	zramfs_maybe_orphan(dentry->d_inode, dentry, 1, 2);
    	return 0;		
 }
 
 int zramfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 				struct inode *new_dir, struct dentry *new_dentry)
 {
-	struct buffer_head* bh = NULL;
-        struct directory *fentry = NULL;
+	struct inode *old_inode = old_dentry->d_inode;
+	struct inode *new_inode = new_dentry->d_inode;
+	int is_dir = S_ISDIR(old_inode->i_mode);
 	int err = 0;
-	void* kmapAddr = NULL;
-	if (new_dentry->d_inode) {
-		drop_nlink(new_dentry->d_inode);
+
+	if (new_inode && is_dir && !zramfs_dir_empty(new_dentry))
+		return -ENOTEMPTY;
+	if (new_inode) {
 		// change the inode
-       		zramfs_find_diretory(new_dir, new_dentry, &bh, &fentry, &kmapAddr);
-	       	if (!fentry) {
+		if (zramfs_update_entry(new_dir, new_dentry, old_inode->i_ino)) {
 			printk(KERN_ERR"zramfs_rename, not find the new_dentry");
 			return -EIO;
 		}	
-		fentry->d_num = old_dentry->d_inode->i_ino;
-		put_bh(bh);
-		if (kmapAddr) {
-			kunmap_atomic(kmapAddr, KM_USER0);
-		}
+		new_inode->i_ctime = CURRENT_TIME;
+		//a directory loses its "." too, new_dir keeps its count: the
+		//victim's ".." goes, ours comes
+		if (is_dir)
+			drop_nlink(new_inode);
+		drop_nlink(new_inode);
+		mark_inode_dirty(new_inode);
+		zramfs_maybe_orphan(new_inode, new_dentry, 1, is_dir ? 2 : 1);
 	} else {
 		// create the dentry
-		new_dentry->d_inode = old_dentry->d_inode;
+		new_dentry->d_inode = old_inode;
 		err =  zramfs_get_valid_diretory(new_dir, new_dentry);
 		new_dentry->d_inode = NULL;
 		if (err)
 			return err;
+		//the ".." of the moved directory counts in its new parent
+		if (is_dir)
+			inc_nlink(new_dir);
 	}
-	kmapAddr = 0;
 	//del the old dentry	
-       	zramfs_find_diretory(old_dir, old_dentry, &bh, &fentry, &kmapAddr); 
-	if (!fentry) {
+	if (zramfs_update_entry(old_dir, old_dentry, 0)) {
 		printk(KERN_ERR"zramfs_rename, not find the old_dentry");
 		return -EIO;
 	}	
-	fentry->d_status = 0;
-	put_bh(bh);	
-	if (kmapAddr) {
-		kunmap_atomic(kmapAddr, KM_USER0);
-	}
+	if (is_dir)
+		drop_nlink(old_dir);
+	old_inode->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(old_inode);
+	old_dir->i_ctime = old_dir->i_mtime = new_dir->i_ctime = new_dir->i_mtime = CURRENT_TIME;
+	mark_inode_dirty(old_dir);
+	mark_inode_dirty(new_dir);
 	return err;
 }
 int zramfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry) {
@@ -1312,6 +1959,8 @@ int zramfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *den
 	inode->i_ctime = dir->i_ctime = dir->i_mtime = CURRENT_TIME;
 	inc_nlink(inode);
 	atomic_inc(&inode->i_count);
+	mark_inode_dirty(inode);
+	mark_inode_dirty(dir);
 
 	d_instantiate(dentry, inode);
 	err =  zramfs_get_valid_diretory(dir, dentry);
@@ -1339,24 +1988,133 @@ static const struct inode_operations ramfs_dir_inode_operations = {
 	//.rename		= simple_rename,
 	.rename		= zramfs_rename,
 	.permission     = permission,
+	.setxattr	= generic_setxattr,
+	.getxattr	= generic_getxattr,
+	.listxattr	= zramfs_listxattr,
+	.removexattr	= generic_removexattr,
 };
 
+long zramfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct super_block *sb = filp->f_dentry->d_inode->i_sb;
+	struct fstrim_range range;
+	u64 bytes, blocks;
+	int err;
+
+	switch (cmd) {
+	case FITRIM:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&range, (struct fstrim_range __user *)arg, sizeof(range)))
+			return -EFAULT;
+		err = zramfs_trim_fs(sb, &range);
+		if (copy_to_user((struct fstrim_range __user *)arg, &range, sizeof(range)))
+			return -EFAULT;
+		return err;
+	case ZRAMFS_IOC_RESIZE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&bytes, (u64 __user *)arg, sizeof(bytes)))
+			return -EFAULT;
+		//userspace has no way to learn the block size, statfs reports the page size
+		blocks = bytes >> sb->s_blocksize_bits;
+		if (bytes && !blocks)
+			return -EINVAL;
+		err = zramfs_resize_fs(sb, &blocks);
+		bytes = blocks << sb->s_blocksize_bits;
+		if (copy_to_user((u64 __user *)arg, &bytes, sizeof(bytes)))
+			return -EFAULT;
+		return err;
+	}
+	return -ENOTTY;
+}
+
 static const struct file_operations zramfs_dir_operations = {
 	//.open		= dcache_dir_open,
-	.release	= dcache_dir_close,
-	.llseek		= dcache_dir_lseek,
+	.llseek		= zramfs_dir_llseek,
 	.read		= generic_read_dir,
 	//.readdir	= dcache_readdir,
 	.readdir	= zramfs_readdir,
+	.unlocked_ioctl	= zramfs_ioctl,
 	.fsync		= simple_sync_file,
 };
 
+/*
+ * may this module mount the volume, read-write if rw. older revisions
+ * have no feature words.
+ */
+static int zramfs_check_features(struct super_block *sb, gzafs_sb_info *sbinfo, int rw)
+{
+	u32 incompat = sbinfo->feature_incompat & ~ZRAMFS_FEATURE_INCOMPAT_SUPP;
+	u32 ro_compat = sbinfo->feature_ro_compat & ~ZRAMFS_FEATURE_RO_COMPAT_SUPP;
+
+	if (sbinfo->rev_level == ZRAMFS_REV_ORIG)
+		return 0;
+	if (incompat) {
+		printk(KERN_ERR "zramfs: %s has unsupported features %x, revision %u\n",
+				sb->s_id, incompat, sbinfo->rev_level);
+		return -EINVAL;
+	}
+	if (rw && ro_compat) {
+		printk(KERN_ERR "zramfs: %s has unsupported features %x, mount it read-only\n",
+				sb->s_id, ro_compat);
+		return -EROFS;
+	}
+	if (!(sbinfo->feature_incompat & ZRAMFS_FEATURE_INCOMPAT_INODE_V2) !=
+			(zramfs_inode_size(sbinfo) == INODE_SIZE)) {
+		printk(KERN_ERR "zramfs: %s, inode size %u doesn't match its features\n",
+				sb->s_id, zramfs_inode_size(sbinfo));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int zramfs_remount(struct super_block *sb, int *flags, char *data)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+
+	if (!(*flags & MS_RDONLY) && (sb->s_flags & MS_RDONLY))
+		return zramfs_check_features(sb, &fsi->sbinfo, 1);
+	return 0;
+}
+
+static void zramfs_put_super(struct super_block *sb)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	zramfs_lazyinit_stop(sb);
+	//inodes are evicted already, let the workers finish their frees
+	flush_work(&fsi->free_work);
+	flush_work(&fsi->discard_work);
+	zramfs_xattr_put_super(sb);
+	zramfs_put_groups(sb);
+}
+
+/*
+ * the inode leaves the cache. a deleted one keeps its info until
+ * zramfs_release_blocks is done with it.
+ */
+static void zramfs_clear_inode(struct inode *inode)
+{
+	struct zramfs_inode_info *info = ZRAMFS_I(inode);
+
+	if (!info)
+		return;
+	zramfs_index_drop(info);
+	if (inode->i_nlink) {
+		inode->i_private = NULL;
+		kfree(info);
+	}
+}
+
 static const struct super_operations ramfs_ops = {
 	.statfs		= simple_statfs,
+	.put_super	= zramfs_put_super,
 	//.drop_inode	= generic_delete_inode,
 	//.alloc_inode   = zramfs_alloc_inode,
 	.write_inode     = zramfs_write_inode,
 	.delete_inode   = zramfs_delete_inode,
+	.clear_inode	= zramfs_clear_inode,
+	.remount_fs	= zramfs_remount,
 	.show_options	= generic_show_options,
 };
 
@@ -1380,6 +2138,34 @@ static int ramfs_parse_options(char *data, struct ramfs_mount_opts *opts)
 				return -EINVAL;
 			opts->mode = option & S_IALLUGO;
 			break;
+		case Opt_async_free:
+			opts->async_free = ASYNC_FREE_DEFAULT;
+			break;
+		case Opt_async_free_blocks:
+			if (match_int(&args[0], &option) || option < 0)
+				return -EINVAL;
+			opts->async_free = option;
+			break;
+		case Opt_discard:
+			opts->discard = 1;
+			break;
+		case Opt_nodiscard:
+			opts->discard = 0;
+			break;
+		case Opt_nolazyinit:
+			opts->nolazyinit = 1;
+			break;
+		case Opt_lazytime:
+			opts->lazytime = LAZYTIME_DEFAULT;
+			break;
+		case Opt_lazytime_age:
+			if (match_int(&args[0], &option) || option < 0)
+				return -EINVAL;
+			opts->lazytime = option;
+			break;
+		case Opt_nolazytime:
+			opts->lazytime = 0;
+			break;
 		/*
 		 * We might like to report bad mount options here;
 		 * but traditionally ramfs has ignored all mount options,
@@ -1409,6 +2195,18 @@ static int ramfs_fill_super(struct super_block * sb, void * data, int silent)
 		goto fail;
 	}
 
+	fsi->sb = sb;
+	spin_lock_init(&fsi->free_lock);
+	INIT_LIST_HEAD(&fsi->free_list);
+	INIT_WORK(&fsi->free_work, zramfs_free_worker);
+	mutex_init(&fsi->orphan_lock);
+	INIT_LIST_HEAD(&fsi->orphan_list);
+	spin_lock_init(&fsi->discard_lock);
+	INIT_LIST_HEAD(&fsi->discard_list);
+	INIT_WORK(&fsi->discard_work, zramfs_discard_worker);
+	mutex_init(&fsi->xattr_lock);
+	mutex_init(&fsi->resize_lock);
+
 	err = ramfs_parse_options(data, &fsi->mount_opts);
 	if (err)
 		goto fail;
@@ -1416,16 +2214,41 @@ static int ramfs_fill_super(struct super_block * sb, void * data, int silent)
 	printk("**read super block\n");
 	get_dev_content(sb->s_bdev, (loff_t)0, (char*)&fsi->sbinfo, sizeof(fsi->sbinfo));
 	printk("**read super block end\n");
+	err = -EINVAL;
 	if (fsi->sbinfo.magic != FS_MAGIC)
 		goto fail;
+	if (!(fsi->sbinfo.flags & ZRAMFS_SB_GROUPS)) {
+		printk(KERN_ERR "zramfs: volume without block groups, format it again\n");
+		goto fail;
+	}
+	err = zramfs_check_features(sb, &fsi->sbinfo, !(sb->s_flags & MS_RDONLY));
+	if (err)
+		goto fail;
+	err = -EINVAL;
 
+	//device blocks are fs blocks from here on, metadata buffers hold one
+	//block each. the device can't go below its sector size.
+	if (fsi->sbinfo.block_size < 1024 || !sb_set_blocksize(sb, fsi->sbinfo.block_size)) {
+		printk(KERN_ERR "zramfs: block size %u not supported by %s, sector size %d\n",
+				fsi->sbinfo.block_size, sb->s_id, bdev_logical_block_size(sb->s_bdev));
+		goto fail;
+	}
 	sb->s_maxbytes		= MAX_LFS_FILESIZE;
-	sb->s_blocksize		= fsi->sbinfo.block_size;
-	sb->s_blocksize_bits	= blksize_bits(sb->s_blocksize);
 	sb->s_magic		= FS_MAGIC;
 	sb->s_op		= &ramfs_ops;
+	sb->s_xattr		= zramfs_xattr_handlers;
 	sb->s_time_gran		= 1;
 
+	err = zramfs_load_groups(sb);
+	if (err)
+		goto fail;
+
+	if (fsi->mount_opts.discard && !blk_queue_discard(bdev_get_queue(sb->s_bdev)))
+		printk(KERN_NOTICE "zramfs: device can't discard, discard option has no effect\n");
+
+	if (fsi->sbinfo.orphan_head)
+		zramfs_orphan_cleanup(sb);
+
 	printk("**read root inode\n");
 	//inode = ramfs_get_inode(sb, S_IFDIR | fsi->mount_opts.mode, 0);
 	inode = zramfs_get_inode_byid(sb, ROOT_INODE_NUM);
@@ -1449,9 +2272,13 @@ static int ramfs_fill_super(struct super_block * sb, void * data, int silent)
 	printk("** block device:%p, queue:%p.\n", sb->s_bdev, bdev_get_queue(sb->s_bdev));
 	printk("** super_block->s_list.next:%p, super_block->s_list->pre:%p.\n", sb->s_list.next, sb->s_list.prev);
 	printk("** inode->i_mapping->backing_dev_info:%p, sb->s_bdev->bd_inode->i_mapggin->backing_dev_info:%p.\n", inode->i_mapping->backing_dev_info, sb->s_bdev->bd_inode->i_mapping->backing_dev_info);
+	if (!fsi->mount_opts.nolazyinit)
+		zramfs_lazyinit_start(sb);
 	printk("** fill super block sucess.\n");
 	return 0;
 fail:
+	if (fsi)
+		zramfs_put_groups(sb);
 	kfree(fsi);
 	sb->s_fs_info = NULL;
 	iput(inode);
@@ -1505,12 +2332,23 @@ static int __init init_ramfs_fs(void)
 		printk(KERN_ERR "init ramfs_backing_dev_info err res:%d", err);
 		return err;
 	}
-	return register_filesystem(&ramfs_fs_type);
+	zramfs_wq = create_singlethread_workqueue("zramfs");
+	if (!zramfs_wq)
+		return -ENOMEM;
+	zramfs_index_init();
+	err = register_filesystem(&ramfs_fs_type);
+	if (err) {
+		zramfs_index_exit();
+		destroy_workqueue(zramfs_wq);
+	}
+	return err;
 }
 
 static void __exit exit_ramfs_fs(void)
 {
 	unregister_filesystem(&ramfs_fs_type);
+	zramfs_index_exit();
+	destroy_workqueue(zramfs_wq);
 }
 
 module_init(init_ramfs_fs)
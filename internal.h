@@ -16,61 +16,299 @@ extern const struct address_space_operations ramfs_aops;
 extern const struct inode_operations ramfs_file_inode_operations;
 
 
-#define GFS_BLOCK_SIZE 1024
-#define GFS_BLOCK_SIZE_BIT 10
-
 #define FS_MAGIC 0x12341234
 
 #define MAX_FILE_BLOCK_NUM 10
 #define MAX_GZA_FILESIZE (MAX_FILE_BLOCK_NUM * BLOCK_SIZE) 
 
-#define INODE_SIZE 64
+#define INODE_SIZE 64		/* version 1, the first part of every inode */
+#define INODE_SIZE_V2 256
 #define DIRECTORY_SIZE 256
 #define INODE_DATA_COUNT 10
 
 #define MAX_DIR_NAME 192
+
+/* linux/falloc.h of this kernel only knows FALLOC_FL_KEEP_SIZE */
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE 0x10
+#endif
+
+/* linux/fs.h of this kernel has no FITRIM yet */
+#ifndef FITRIM
+struct fstrim_range {
+	__u64 start;
+	__u64 len;
+	__u64 minlen;
+};
+#define FITRIM _IOWR('X', 121, struct fstrim_range)
+#endif
+
 #define ROOT_INODE_NUM 1
+#define ZRAMFS_XATTR_INLINE_SIZE 128
 struct gza_inode 
 {
 	u32 num;
 	umode_t mode;
-	int length;
+	u16 unwritten;	/* bit n set: data[n] is preallocated, reads as zero */
+	int length;	/* the low 32 bits of the size */
 	dev_t dev;
 	unsigned int data[10];
+	u32 next_orphan;	/* next inode of the orphan list, only written under orphan_lock */
+	u32 flags;		/* ZRAMFS_INODE_*, 0 in inodes of older volumes */
+	/* version 2 from here on, only on volumes with INODE_SIZE_V2 inodes */
+	u32 size_high;
+	u32 nlink;
+	u32 uid;
+	u32 gid;
+	u64 atime;
+	u64 mtime;
+	u64 ctime;
+	u32 atime_nsec;
+	u32 mtime_nsec;
+	u32 ctime_nsec;
+	u32 xattr_block;	/* shared block of the attributes that don't fit below, 0 none */
+	u8 xattr[ZRAMFS_XATTR_INLINE_SIZE];	/* struct zramfs_xattr_entry list, see xattr.c */
+	u32 reserved[2];
+};
+
+/*
+ * data[] holds the file itself, see file-mmu.c, i_size never exceeds it.
+ * of a symlink the target, of a directory its entries, see dir.c.
+ */
+#define ZRAMFS_INODE_INLINE 0x0001
+/* the same 40 bytes in both inode versions, the v2 room went to times and xattrs */
+#define ZRAMFS_INLINE_SIZE (INODE_DATA_COUNT * sizeof(unsigned int))
+
+static inline int zramfs_inline(struct inode *inode)
+{
+	return ((struct gza_inode *)inode->i_private)->flags & ZRAMFS_INODE_INLINE;
+}
+
+#define ZRAMFS_BLOOM_BITS 512
+
+/* in-core inode, i_private; ginode first, it is used as struct gza_inode too */
+struct zramfs_inode_info {
+	struct gza_inode ginode;
+	struct list_head orphan;	/* on ramfs_fs_info.orphan_list, same order as on disk */
+	unsigned long time_dirty;	/* jiffies of the oldest time change not on disk, 0 none */
+	/*
+	 * directories: shared to read entries or to add or clear one under
+	 * the buffer lock of its block, exclusive to add a block
+	 */
+	struct rw_semaphore dir_sem;
+	spinlock_t index_lock;		/* index and dir_gen */
+	struct zramfs_dir_index *index;	/* names in memory, see dir.c */
+	unsigned long dir_gen;		/* bumped on every entry change */
+	/* every name of the directory is in it once bloom_valid, see dir.c */
+	unsigned long bloom[ZRAMFS_BLOOM_BITS / BITS_PER_LONG];
+	int bloom_valid;
+	u32 free_hint;	/* the slots before this byte are taken, under the dir i_mutex */
+	struct rw_semaphore xattr_sem;	/* xattr and xattr_block of ginode */
 };
 
+static inline struct zramfs_inode_info *ZRAMFS_I(struct inode *inode)
+{
+	return (struct zramfs_inode_info *)inode->i_private;
+}
+
 typedef struct
 {
-	u32 inode_bitmap_begin;
-	u32 inode_bitmap_block_num;
+	u32 inodes_per_group;
+	u32 blocks_per_group;	/* its bitmaps and inode table included */
 	u32 inode_num;
-	u32 data_bitmap_begin;
-	u32 data_bitmap_block_num;
-	u32 data_num;
-	u32 inode_begin;
-	u32 inode_block_num;
-	u32 data_begin;
-	u32 data_block_num;
+	u32 group_count;
+	u32 gdt_begin;		/* group descriptor table */
+	u32 gdt_block_num;
+	u32 first_group_block;	/* first block of group 0 */
+	u32 block_num;		/* blocks used by the fs, the last group may be short */
+	u32 itable_block_num;	/* inode table blocks of each group */
+	u32 data_num;		/* data blocks of all groups */
 	u32 block_size;
 	
 	u32 magic;
+	u32 orphan_head;	/* first inode unlinked but not yet freed */
+	u32 flags;		/* ZRAMFS_SB_* */
+	u32 inode_size;		/* INODE_SIZE or INODE_SIZE_V2, 0 on older volumes */
+	u32 rev_level;		/* ZRAMFS_REV_*, the feature words are only read from 1 on */
+	u32 feature_compat;	/* ZRAMFS_FEATURE_COMPAT_*, any module may mount it */
+	u32 feature_incompat;	/* ZRAMFS_FEATURE_INCOMPAT_*, only a module knowing them all */
+	u32 feature_ro_compat;	/* ZRAMFS_FEATURE_RO_COMPAT_*, others mount it read-only */
 
 } __attribute__ ((packed)) gzafs_sb_info;
 
+static inline u32 zramfs_inode_size(gzafs_sb_info *sbinfo)
+{
+	return sbinfo->inode_size ? sbinfo->inode_size : INODE_SIZE;
+}
+
+/* some group is only partly initialised, see lazyinit.c */
+#define ZRAMFS_SB_UNINIT 0x0001
+/* block group layout; older volumes had one inode table and data region */
+#define ZRAMFS_SB_GROUPS 0x0002
+
+/*
+ * revision 0 volumes predate the feature words and are mounted as they
+ * are. from revision 1 on a module refuses a volume with an incompat
+ * feature it doesn't know, and mounts one with an unknown ro_compat
+ * feature read-only. unknown compat features are fine.
+ */
+#define ZRAMFS_REV_ORIG 0
+#define ZRAMFS_REV_FEATURES 1
+#define ZRAMFS_REV_LEVEL ZRAMFS_REV_FEATURES
+
+#define ZRAMFS_FEATURE_COMPAT_XATTR		0x0001	/* xattr blocks, see xattr.c */
+
+#define ZRAMFS_FEATURE_INCOMPAT_INLINE_DATA	0x0001	/* ZRAMFS_INODE_INLINE inodes */
+#define ZRAMFS_FEATURE_INCOMPAT_INODE_V2	0x0002	/* INODE_SIZE_V2 inodes */
+#define ZRAMFS_FEATURE_INCOMPAT_BLOCKS32	0x0004	/* more than 2^31 blocks, all 32 bits used */
+
+#define ZRAMFS_FEATURE_COMPAT_SUPP	ZRAMFS_FEATURE_COMPAT_XATTR
+#define ZRAMFS_FEATURE_INCOMPAT_SUPP	(ZRAMFS_FEATURE_INCOMPAT_INLINE_DATA | \
+					 ZRAMFS_FEATURE_INCOMPAT_INODE_V2 | \
+					 ZRAMFS_FEATURE_INCOMPAT_BLOCKS32)
+#define ZRAMFS_FEATURE_RO_COMPAT_SUPP	0
+
+/*
+ * a group starts with its block bitmap, then the inode bitmap and the
+ * inode table, the rest is data. bit n of the block bitmap is block
+ * begin + n, inode n of group g is g * inodes_per_group + n.
+ */
+struct zramfs_group_desc {
+	u32 block_bitmap;
+	u32 inode_bitmap;
+	u32 inode_table;
+	u32 flags;		/* ZRAMFS_BG_* */
+	u32 itable_inited;	/* inode table blocks zeroed so far */
+	u32 used_dirs;		/* a placement hint, not kept in sync on disk */
+	u32 reserved[2];
+};
+
+#define ZRAMFS_BG_BLOCK_UNINIT 0x0001	/* block bitmap never written */
+#define ZRAMFS_BG_INODE_UNINIT 0x0002	/* inode bitmap never written */
+
+/* a short last group needs this many data blocks, or it is left out */
+#define ZRAMFS_MIN_GROUP_DATA 16
+
+/* grow a mounted volume to the given size in bytes, 0 for the whole device.
+ * the new size comes back in it. */
+#define ZRAMFS_IOC_RESIZE _IOWR('z', 1, __u64)
+
+/* in-core group, the counters are counted from the bitmaps at mount */
+struct zramfs_group {
+	struct mutex lock;	/* bitmaps, counters and desc of this group */
+	struct zramfs_group_desc desc;
+	u32 begin;
+	u32 block_count;
+	u32 free_blocks;
+	u32 free_inodes;
+	struct list_head pools;	/* zramfs_pool with a run here */
+};
+
+/*
+ * a run of blocks a cpu reserved in a group, free in the bitmap until
+ * zramfs_sync_pools sets the ones handed out. list, begin and end change
+ * under both the group lock and lock.
+ */
+struct zramfs_pool {
+	spinlock_t lock;	/* nested in the lock of the group the run is in */
+	struct list_head list;	/* in the group's pools while it has a run */
+	u32 begin;		/* the run reserved */
+	u32 end;
+	u32 synced;		/* blocks before it are set in the bitmap */
+	u32 block;		/* next block */
+};
+
+#define ZRAMFS_POOL_BLOCKS 16
+
 struct directory {
 	char d_name[MAX_DIR_NAME];
 	int d_len;
 	int d_status;
 	int d_num;
+	u32 d_hash;	/* zramfs_name_hash of the name, 0 in entries of older volumes */
+};
+
+/*
+ * an extended attribute, in the inode or in an xattr block, the value
+ * follows the name. e_index 0 ends the list.
+ */
+struct zramfs_xattr_entry {
+	u8 e_index;		/* ZRAMFS_XATTR_INDEX_* */
+	u8 e_name_len;
+	u16 e_value_len;
+	char e_name[0];
+} __attribute__ ((packed));
+
+#define ZRAMFS_XATTR_INDEX_USER		1
+#define ZRAMFS_XATTR_INDEX_TRUSTED	2
+#define ZRAMFS_XATTR_INDEX_SECURITY	3
+
+/* one fs block, the entries follow. inodes with equal entries share it */
+struct zramfs_xattr_header {
+	u32 h_magic;
+	u32 h_refcount;
+	u32 h_hash;		/* zramfs_name_hash of the entries part */
+	u32 h_reserved;
 };
 
+#define ZRAMFS_XATTR_MAGIC 0x58415454
+#define ZRAMFS_XATTR_REFCOUNT_MAX 1024
+#define ZRAMFS_XATTR_CACHE_SIZE 64
+
 struct ramfs_mount_opts {
 	umode_t mode;
+	unsigned int async_free;	/* blocks from which frees go to the worker, 0 off */
+	int discard;			/* discard freed blocks before reusing them */
+	int nolazyinit;			/* no thread, groups are only initialised on use */
+	unsigned int lazytime;		/* seconds a time-only change may stay in memory, 0 off */
 };
 
+#define ASYNC_FREE_DEFAULT 4
+#define LAZYTIME_DEFAULT (24 * 60 * 60)
+
 struct ramfs_fs_info {
 	struct ramfs_mount_opts mount_opts;
 	gzafs_sb_info sbinfo;
+	struct super_block *sb;
+	struct zramfs_group **groups;	/* chunks, see zramfs_group() */
+	u32 group_max;			/* descriptors that fit in the gdt blocks */
+	struct mutex resize_lock;	/* adds chunks of groups */
+	struct zramfs_pool *pools;	/* per cpu */
+	spinlock_t free_lock;
+	struct list_head free_list;	/* struct zramfs_free_work waiting for free_work */
+	struct work_struct free_work;
+	struct mutex orphan_lock;
+	struct list_head orphan_list;	/* zramfs_inode_info, head first */
+	spinlock_t discard_lock;
+	struct list_head discard_list;	/* freed runs, still set in the bitmap */
+	struct work_struct discard_work;
+	struct task_struct *lazyinit_task;
+	struct mutex xattr_lock;	/* xattr block refcounts and xattr_cache */
+	struct hlist_head xattr_cache[ZRAMFS_XATTR_CACHE_SIZE];	/* xattr blocks by hash */
+};
+
+/*
+ * in-core groups come in page sized chunks, allocated as far as the
+ * groups in use go. a resize adds chunks and never moves a group.
+ */
+#define ZRAMFS_GROUPS_PER_CHUNK (PAGE_SIZE / sizeof(struct zramfs_group))
+
+static inline struct zramfs_group *zramfs_group(struct ramfs_fs_info *fsi, u32 group)
+{
+	return &fsi->groups[group / ZRAMFS_GROUPS_PER_CHUNK][group % ZRAMFS_GROUPS_PER_CHUNK];
+}
+
+extern struct workqueue_struct *zramfs_wq;
+
+/* blocks (and an inode number) handed to the background worker */
+struct zramfs_free_work {
+	struct list_head list;
+	struct zramfs_inode_info *info;	/* deleted inode, freed after the blocks */
+	int count;
+	unsigned int blocks[INODE_DATA_COUNT];
 };
 
 enum SET_FLAG{
@@ -79,13 +317,76 @@ enum SET_FLAG{
 };
 
 
-int clear_bdev_block_content(struct block_device *bdev, int block_num, int block_size);
+int clear_bdev_block_content(struct block_device *bdev, sector_t block_num, int block_size);
 int get_dev_content(struct block_device *bdev, loff_t offset, char * buff, int size);
 void set_dev_content(struct block_device *bdev, loff_t offset, char * buff, int size);
 void set_dev_bit(struct block_device *bdev, loff_t offset, int bitoffset, enum SET_FLAG);
 int find_valid_inode_num(struct block_device *bdev, loff_t begin, loff_t end);
 int find_valid_data_num(struct block_device *bdev, loff_t begin, loff_t end);
 int find_valid_bit_num(struct block_device *bdev, loff_t begin, loff_t end);
+int clear_dev_bits(struct block_device *bdev, loff_t begin, unsigned int *bits, int count);
+unsigned int find_free_run(struct block_device *bdev, loff_t begin, unsigned int from, unsigned int to, unsigned int max, unsigned int *run);
+unsigned int count_dev_bits(struct block_device *bdev, loff_t begin, unsigned int nbits);
+int set_dev_bit_range(struct block_device *bdev, loff_t begin, unsigned int first, unsigned int count, enum SET_FLAG flag);
+int zero_dev_range(struct block_device *bdev, loff_t offset, loff_t len);
 
 int gfs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh, int create); 
+
+int zramfs_load_groups(struct super_block *sb);
+void zramfs_put_groups(struct super_block *sb);
+void zramfs_drain_pools(struct super_block *sb);
+void zramfs_sync_pools(struct super_block *sb);
+unsigned int zramfs_find_free_run(struct super_block *sb, u32 group, unsigned int from, unsigned int to, unsigned int max, unsigned int *bit);
+int zramfs_write_group_desc(struct super_block *sb, u32 group, int sync);
+int zramfs_resize_fs(struct super_block *sb, u64 *blocks);
+u32 zramfs_group_meta_blocks(gzafs_sb_info *sbinfo);
+loff_t zramfs_inode_offset(struct super_block *sb, u32 ino);
+u32 zramfs_new_inode_num(struct super_block *sb, const struct inode *dir, int mode);
+void zramfs_free_inode_num(struct super_block *sb, u32 ino, int is_dir);
+u32 zramfs_get_data_block(struct inode *inode, sector_t iblock);
+void zramfs_clear_block_run(struct super_block *sb, unsigned int block, unsigned int count);
+void zramfs_free_data_block(struct super_block *sb, unsigned int block);
+void zramfs_sync_block_bitmaps(struct super_block *sb, unsigned int *blocks, int count);
+void zramfs_free_data_blocks(struct super_block *sb, unsigned int *blocks, int count);
+void zramfs_release_blocks(struct super_block *sb, unsigned int *blocks, int count, struct zramfs_inode_info *info);
+int zramfs_inline_convert(struct inode *inode);
+
+extern struct xattr_handler *zramfs_xattr_handlers[];
+ssize_t zramfs_listxattr(struct dentry *dentry, char *buffer, size_t size);
+int zramfs_xattr_get(struct inode *inode, int index, const char *name, void *buffer, size_t size);
+int zramfs_xattr_set(struct inode *inode, int index, const char *name, const void *value, size_t size, int flags);
+void zramfs_xattr_release(struct super_block *sb, u32 block);
+int zramfs_init_security(struct inode *inode, struct inode *dir);
+void zramfs_xattr_put_super(struct super_block *sb);
+long zramfs_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len);
+long zramfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+void zramfs_queue_discard(struct super_block *sb, unsigned int *blocks, int count);
+void zramfs_discard_worker(struct work_struct *work);
+int zramfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+
+int zramfs_write_sb(struct super_block *sb);
+int zramfs_set_feature_incompat(struct super_block *sb, u32 feature);
+int zramfs_init_block_bitmap(struct super_block *sb, u32 group);
+int zramfs_init_inode_bitmap(struct super_block *sb, u32 group);
+void zramfs_init_itable(struct super_block *sb, u32 ino);
+void zramfs_lazyinit_start(struct super_block *sb);
+void zramfs_lazyinit_stop(struct super_block *sb);
+
+u32 zramfs_name_hash(const char *name, int len);
+struct buffer_head *zramfs_dir_bread(struct inode *dir, u32 pos, int *offset);
+void zramfs_dir_readahead(struct inode *dir, u32 pos);
+int zramfs_index_build(struct inode *dir);
+void zramfs_index_drop(struct zramfs_inode_info *info);
+int zramfs_index_lookup(struct inode *dir, const char *name, int len, u32 *ino, u32 *pos);
+void zramfs_index_add(struct inode *dir, const char *name, int len, u32 ino, u32 pos);
+void zramfs_index_update(struct inode *dir, const char *name, int len, u32 ino);
+int zramfs_inline_dir_find(struct inode *dir, const char *name, int len, u32 *ino);
+int zramfs_inline_dir_add(struct inode *dir, const char *name, int len, u32 ino);
+int zramfs_inline_dir_set(struct inode *dir, const char *name, int len, u32 ino);
+int zramfs_inline_dir_empty(struct inode *dir);
+void zramfs_inline_dir_readdir(struct inode *dir, struct file *filp, void *dirent, filldir_t filldir, int first);
+int zramfs_inline_dir_convert(struct inode *dir);
+void zramfs_index_init(void);
+void zramfs_index_exit(void);
 #endif
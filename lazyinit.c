@@ -0,0 +1,218 @@
+/* lazyinit.c: initialise the group bitmaps and inode tables after mkfs
+ *
+ * format.c only writes the metadata of group 0. The other groups are
+ * flagged uninitialised in their descriptors; an allocator initialises a
+ * bitmap the first time it uses the group, a new inode zeroes the inode
+ * table up to its block, and a kernel thread finishes the rest after
+ * mount.
+ *
+ * This file is released under the GPL.
+ */
+
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include "internal.h"
+
+/* inode table blocks per step of the thread, and its pause between steps */
+#define LAZYINIT_BATCH 64
+#define LAZYINIT_DELAY 20
+
+/*
+ * write a bitmap block with only bits [0, head) and [valid, end) set, its
+ * zeroes reach the disk before the descriptor saying it is valid does
+ */
+static int init_bitmap(struct super_block *sb, u32 block, u32 head, u32 valid)
+{
+	struct block_device *bdev = sb->s_bdev;
+	u32 bs = sb->s_blocksize;
+	loff_t begin = (loff_t)block * bs;
+	int err;
+
+	err = zero_dev_range(bdev, begin, bs);
+	if (!err && head)
+		err = set_dev_bit_range(bdev, begin, 0, head, SET);
+	if (!err && valid < bs * 8)
+		err = set_dev_bit_range(bdev, begin, valid, bs * 8 - valid, SET);
+	//only this block, not every dirty buffer of the device
+	if (!err)
+		err = filemap_write_and_wait_range(bdev->bd_inode->i_mapping, begin, begin + bs - 1);
+	return err;
+}
+
+/**
+ * first use of a group with ZRAMFS_BG_BLOCK_UNINIT, its lock held
+ */
+int zramfs_init_block_bitmap(struct super_block *sb, u32 group)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+	int err;
+
+	err = init_bitmap(sb, grp->desc.block_bitmap,
+			zramfs_group_meta_blocks(&fsi->sbinfo), grp->block_count);
+	if (!err) {
+		grp->desc.flags &= ~ZRAMFS_BG_BLOCK_UNINIT;
+		err = zramfs_write_group_desc(sb, group, 1);
+	}
+	if (err)
+		printk(KERN_ERR "zramfs_init_block_bitmap, group:%u, err:%d\n", group, err);
+	return err;
+}
+
+/**
+ * first use of a group with ZRAMFS_BG_INODE_UNINIT, its lock held
+ */
+int zramfs_init_inode_bitmap(struct super_block *sb, u32 group)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+	int err;
+
+	err = init_bitmap(sb, grp->desc.inode_bitmap, 0, fsi->sbinfo.inodes_per_group);
+	if (!err) {
+		grp->desc.flags &= ~ZRAMFS_BG_INODE_UNINIT;
+		err = zramfs_write_group_desc(sb, group, 1);
+	}
+	if (err)
+		printk(KERN_ERR "zramfs_init_inode_bitmap, group:%u, err:%d\n", group, err);
+	return err;
+}
+
+/*
+ * zero up to count more inode table blocks of a group, its lock held.
+ * returns the number of blocks zeroed.
+ */
+static u32 init_itable(struct super_block *sb, u32 group, u32 count)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+	u32 bs = sb->s_blocksize;
+	u32 inited = grp->desc.itable_inited;
+	u32 n = fsi->sbinfo.itable_block_num - inited;
+	loff_t begin;
+	int err;
+
+	if (n > count)
+		n = count;
+	if (!n)
+		return 0;
+	begin = (loff_t)(grp->desc.inode_table + inited) * bs;
+	err = zero_dev_range(sb->s_bdev, begin, (loff_t)n * bs);
+	//the zeroes reach the disk before the watermark does
+	if (!err)
+		err = filemap_write_and_wait_range(sb->s_bdev->bd_inode->i_mapping,
+				begin, begin + (loff_t)n * bs - 1);
+	if (!err) {
+		grp->desc.itable_inited = inited + n;
+		err = zramfs_write_group_desc(sb, group, 1);
+	}
+	if (err) {
+		printk(KERN_ERR "zramfs: init inode table, group:%u, block:%u, err:%d\n", group, inited, err);
+		return 0;
+	}
+	return n;
+}
+
+/**
+ * make sure the inode table block holding ino is initialised
+ */
+void zramfs_init_itable(struct super_block *sb, u32 ino)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	gzafs_sb_info *sbinfo = &fsi->sbinfo;
+	u32 group = ino / sbinfo->inodes_per_group;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+	u32 block = (ino % sbinfo->inodes_per_group) * zramfs_inode_size(sbinfo) / sbinfo->block_size;
+
+	mutex_lock(&grp->lock);
+	if (grp->desc.itable_inited <= block)
+		init_itable(sb, group, block + 1 - grp->desc.itable_inited);
+	mutex_unlock(&grp->lock);
+}
+
+/*
+ * one step of the thread on a group, returns 0 once it is done
+ */
+static u32 zramfs_lazy_init_group(struct super_block *sb, u32 group)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+	u32 n = 0;
+
+	mutex_lock(&grp->lock);
+	if ((grp->desc.flags & ZRAMFS_BG_BLOCK_UNINIT) && !zramfs_init_block_bitmap(sb, group))
+		n++;
+	if ((grp->desc.flags & ZRAMFS_BG_INODE_UNINIT) && !zramfs_init_inode_bitmap(sb, group))
+		n++;
+	n += init_itable(sb, group, LAZYINIT_BATCH);
+	mutex_unlock(&grp->lock);
+	return n;
+}
+
+static int zramfs_group_inited(struct super_block *sb, u32 group)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_group *grp = zramfs_group(fsi, group);
+
+	return !(grp->desc.flags & (ZRAMFS_BG_BLOCK_UNINIT | ZRAMFS_BG_INODE_UNINIT)) &&
+		grp->desc.itable_inited >= fsi->sbinfo.itable_block_num;
+}
+
+static int zramfs_lazyinit_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	u32 group = 0;
+
+	while (!kthread_should_stop() && group < fsi->sbinfo.group_count) {
+		if (!zramfs_lazy_init_group(sb, group)) {
+			group++;
+			continue;
+		}
+		msleep_interruptible(LAZYINIT_DELAY);
+	}
+	//an io error leaves a group behind, it is tried again next mount
+	for (group = 0; group < fsi->sbinfo.group_count; group++)
+		if (!zramfs_group_inited(sb, group))
+			break;
+	if (group == fsi->sbinfo.group_count) {
+		fsi->sbinfo.flags &= ~ZRAMFS_SB_UNINIT;
+		zramfs_write_sb(sb);
+	}
+	printk(KERN_NOTICE "zramfs: lazy init done, flags:%x\n", fsi->sbinfo.flags);
+	//kthread_stop needs us alive
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+void zramfs_lazyinit_start(struct super_block *sb)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct task_struct *task;
+
+	if (!(fsi->sbinfo.flags & ZRAMFS_SB_UNINIT) || (sb->s_flags & MS_RDONLY))
+		return;
+	task = kthread_run(zramfs_lazyinit_thread, sb, "zramfs_init/%s", sb->s_id);
+	if (IS_ERR(task)) {
+		printk(KERN_NOTICE "zramfs: no lazy init thread, err:%ld\n", PTR_ERR(task));
+		return;
+	}
+	fsi->lazyinit_task = task;
+}
+
+void zramfs_lazyinit_stop(struct super_block *sb)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+
+	if (fsi->lazyinit_task)
+		kthread_stop(fsi->lazyinit_task);
+	fsi->lazyinit_task = NULL;
+}
@@ -0,0 +1,69 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<string.h>
+#include<sys/ioctl.h>
+#include<linux/types.h>
+
+/* grow a mounted volume to the given size in bytes, 0 for the whole device.
+ * the new size comes back in it. */
+#define ZRAMFS_IOC_RESIZE _IOWR('z', 1, __u64)
+
+static void usage(const char *prog)
+{
+	printf("usage: %s mountpoint [size]\n", prog);
+	printf("  size  new size in bytes, k, m, g or t suffix allowed, default the whole device\n");
+}
+
+static unsigned long long parse_size(const char *s)
+{
+	char *end;
+	unsigned long long size = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 't': case 'T':
+		size <<= 10;
+		/* fall through */
+	case 'g': case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		size <<= 10;
+	}
+	return size;
+}
+
+int main(int argc, char* argv[])
+{
+	__u64 size = 0;
+	int fp;
+
+	if (argc < 2 || argc > 3) {
+		usage(argv[0]);
+		return 1;
+	}
+	fp = open(argv[1], O_RDONLY);
+	if (fp < 0) {
+		printf("open failed: %s\n", strerror(errno));
+		return 1;
+	}
+	if (argc == 3) {
+		size = parse_size(argv[2]);
+		if (!size) {
+			printf("bad size %s\n", argv[2]);
+			return 1;
+		}
+	}
+	if (ioctl(fp, ZRAMFS_IOC_RESIZE, &size) < 0) {
+		printf("resize failed: %s, size:%llu\n", strerror(errno), (unsigned long long)size);
+		return 1;
+	}
+	printf("resized, size:%llu\n", (unsigned long long)size);
+	close(fp);
+	return 0;
+}
@@ -0,0 +1,591 @@
+/* xattr.c: extended attributes
+ *
+ * The attributes of an inode are a list of struct zramfs_xattr_entry in
+ * the xattr area of the version 2 inode. Those that don't fit there go
+ * to one xattr block. Inodes with the same overflow entries share the
+ * block: a hash of its entries finds an equal block in xattr_cache and
+ * h_refcount counts its users. A block is never changed while shared, a
+ * set writes the new entries to another (or an equal) block and drops
+ * the old one.
+ *
+ * This file is released under the GPL.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/xattr.h>
+#include <linux/security.h>
+#include <linux/capability.h>
+#include "internal.h"
+
+#define XATTR_HDR sizeof(struct zramfs_xattr_header)
+#define XATTR_ENTRY_LEN(e) (sizeof(struct zramfs_xattr_entry) + (e)->e_name_len + (e)->e_value_len)
+
+struct zramfs_xattr_cached {
+	struct hlist_node node;
+	u32 hash;
+	u32 block;
+};
+
+/*
+ * next entry of the list in [area, end), NULL at its end or at an entry
+ * that would run past it
+ */
+static struct zramfs_xattr_entry *xattr_next(char *area, char *end, struct zramfs_xattr_entry *e)
+{
+	char *p = e ? (char *)e + XATTR_ENTRY_LEN(e) : area;
+
+	e = (struct zramfs_xattr_entry *)p;
+	if (p + sizeof(*e) > end || !e->e_index || p + XATTR_ENTRY_LEN(e) > end)
+		return NULL;
+	return e;
+}
+
+static struct zramfs_xattr_entry *xattr_find(char *area, int len, int index,
+		const char *name, int name_len)
+{
+	struct zramfs_xattr_entry *e = NULL;
+
+	while ((e = xattr_next(area, area + len, e)) != NULL) {
+		if (e->e_index == index && e->e_name_len == name_len &&
+				!memcmp(e->e_name, name, name_len))
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * append the entries of [area, area + len) but the one of name to to,
+ * returns the bytes appended, *found is set if name was there
+ */
+static int xattr_copy(char *to, char *area, int len, int index,
+		const char *name, int name_len, int *found)
+{
+	struct zramfs_xattr_entry *e = NULL;
+	int n = 0;
+
+	while ((e = xattr_next(area, area + len, e)) != NULL) {
+		if (e->e_index == index && e->e_name_len == name_len &&
+				!memcmp(e->e_name, name, name_len)) {
+			*found = 1;
+			continue;
+		}
+		memcpy(to + n, e, XATTR_ENTRY_LEN(e));
+		n += XATTR_ENTRY_LEN(e);
+	}
+	return n;
+}
+
+static loff_t xattr_block_offset(struct super_block *sb, u32 block)
+{
+	return (loff_t)block << sb->s_blocksize_bits;
+}
+
+/*
+ * read the xattr block into buf, a block size buffer
+ */
+static int xattr_read_block(struct super_block *sb, u32 block, char *buf)
+{
+	struct zramfs_xattr_header *hdr = (struct zramfs_xattr_header *)buf;
+	gzafs_sb_info *sbinfo = &((struct ramfs_fs_info *)sb->s_fs_info)->sbinfo;
+
+	if (block < sbinfo->first_group_block || block >= sbinfo->block_num)
+		goto bad;
+	get_dev_content(sb->s_bdev, xattr_block_offset(sb, block), buf, sb->s_blocksize);
+	if (hdr->h_magic == ZRAMFS_XATTR_MAGIC && hdr->h_refcount)
+		return 0;
+bad:
+	printk(KERN_ERR "zramfs: bad xattr block %u\n", block);
+	return -EIO;
+}
+
+static struct hlist_head *xattr_bucket(struct ramfs_fs_info *fsi, u32 hash)
+{
+	return &fsi->xattr_cache[hash % ZRAMFS_XATTR_CACHE_SIZE];
+}
+
+/* under xattr_lock */
+static void xattr_cache_add(struct ramfs_fs_info *fsi, u32 hash, u32 block)
+{
+	struct zramfs_xattr_cached *c;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(c, pos, xattr_bucket(fsi, hash), node) {
+		if (c->block == block)
+			return;
+	}
+	c = kmalloc(sizeof(*c), GFP_NOFS);
+	if (!c)
+		return;
+	c->hash = hash;
+	c->block = block;
+	hlist_add_head(&c->node, xattr_bucket(fsi, hash));
+}
+
+/* under xattr_lock */
+static void xattr_cache_del(struct ramfs_fs_info *fsi, u32 hash, u32 block)
+{
+	struct zramfs_xattr_cached *c;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(c, pos, xattr_bucket(fsi, hash), node) {
+		if (c->block == block) {
+			hlist_del(&c->node);
+			kfree(c);
+			return;
+		}
+	}
+}
+
+/*
+ * a block with the entries of buf, a block size buffer with room for the
+ * header: an equal shared one or a new one, its number in *block.
+ */
+static int xattr_block_get(struct inode *inode, char *buf, u32 *block)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_xattr_header *hdr = (struct zramfs_xattr_header *)buf;
+	struct zramfs_xattr_header *old;
+	struct zramfs_xattr_cached *c;
+	struct hlist_node *pos, *n;
+	int size = sb->s_blocksize;
+	u32 hash = zramfs_name_hash(buf + XATTR_HDR, size - XATTR_HDR);
+	char *tmp;
+	int err = 0;
+
+	tmp = kmalloc(size, GFP_NOFS);
+	if (!tmp)
+		return -ENOMEM;
+	old = (struct zramfs_xattr_header *)tmp;
+	mutex_lock(&fsi->xattr_lock);
+	hlist_for_each_entry_safe(c, pos, n, xattr_bucket(fsi, hash), node) {
+		if (c->hash != hash)
+			continue;
+		//a stale entry, the block went away or changed
+		if (xattr_read_block(sb, c->block, tmp) || old->h_hash != hash) {
+			hlist_del(&c->node);
+			kfree(c);
+			continue;
+		}
+		if (old->h_refcount >= ZRAMFS_XATTR_REFCOUNT_MAX ||
+				memcmp(tmp + XATTR_HDR, buf + XATTR_HDR, size - XATTR_HDR))
+			continue;
+		old->h_refcount++;
+		set_dev_content(sb->s_bdev, xattr_block_offset(sb, c->block), tmp, XATTR_HDR);
+		*block = c->block;
+		goto out;
+	}
+	*block = zramfs_get_data_block(inode, 0);
+	err = -ENOSPC;
+	if (!*block)
+		goto out;
+	err = 0;
+	hdr->h_magic = ZRAMFS_XATTR_MAGIC;
+	hdr->h_refcount = 1;
+	hdr->h_hash = hash;
+	hdr->h_reserved = 0;
+	set_dev_content(sb->s_bdev, xattr_block_offset(sb, *block), buf, size);
+	xattr_cache_add(fsi, hash, *block);
+out:
+	mutex_unlock(&fsi->xattr_lock);
+	kfree(tmp);
+	return err;
+}
+
+/**
+ * drop a user of an xattr block, the last one frees it
+ */
+void zramfs_xattr_release(struct super_block *sb, u32 block)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_xattr_header hdr;
+
+	if (!block)
+		return;
+	mutex_lock(&fsi->xattr_lock);
+	get_dev_content(sb->s_bdev, xattr_block_offset(sb, block), (char *)&hdr, sizeof(hdr));
+	if (hdr.h_magic != ZRAMFS_XATTR_MAGIC || !hdr.h_refcount) {
+		printk(KERN_ERR "zramfs: bad xattr block %u, not freed\n", block);
+		goto out;
+	}
+	if (--hdr.h_refcount) {
+		set_dev_content(sb->s_bdev, xattr_block_offset(sb, block), (char *)&hdr, sizeof(hdr));
+		//known from now on, also when it was shared before this mount
+		xattr_cache_add(fsi, hdr.h_hash, block);
+		goto out;
+	}
+	xattr_cache_del(fsi, hdr.h_hash, block);
+	zramfs_free_data_block(sb, block);
+out:
+	mutex_unlock(&fsi->xattr_lock);
+}
+
+static int xattr_supported(struct inode *inode)
+{
+	struct ramfs_fs_info *fsi = inode->i_sb->s_fs_info;
+
+	return zramfs_inode_size(&fsi->sbinfo) >= INODE_SIZE_V2;
+}
+
+/**
+ * copy the value of an attribute to buffer, or only return its size
+ * when buffer is NULL
+ */
+int zramfs_xattr_get(struct inode *inode, int index, const char *name, void *buffer, size_t size)
+{
+	struct zramfs_inode_info *info = ZRAMFS_I(inode);
+	struct gza_inode *ginode = &info->ginode;
+	struct zramfs_xattr_entry *e;
+	int name_len;
+	char *buf = NULL;
+	int err;
+
+	if (!name)
+		return -EINVAL;
+	if (!xattr_supported(inode))
+		return -EOPNOTSUPP;
+	name_len = strlen(name);
+	if (name_len > 255)
+		return -ERANGE;
+	down_read(&info->xattr_sem);
+	e = xattr_find(ginode->xattr, ZRAMFS_XATTR_INLINE_SIZE, index, name, name_len);
+	if (!e && ginode->xattr_block) {
+		err = -ENOMEM;
+		buf = kmalloc(inode->i_sb->s_blocksize, GFP_NOFS);
+		if (!buf)
+			goto out;
+		err = xattr_read_block(inode->i_sb, ginode->xattr_block, buf);
+		if (err)
+			goto out;
+		e = xattr_find(buf + XATTR_HDR, inode->i_sb->s_blocksize - XATTR_HDR,
+				index, name, name_len);
+	}
+	err = -ENODATA;
+	if (!e)
+		goto out;
+	err = e->e_value_len;
+	if (buffer) {
+		if (e->e_value_len > size)
+			err = -ERANGE;
+		else
+			memcpy(buffer, e->e_name + e->e_name_len, e->e_value_len);
+	}
+out:
+	up_read(&info->xattr_sem);
+	kfree(buf);
+	return err;
+}
+
+/**
+ * set an attribute, or remove it when value is NULL. flags are
+ * XATTR_CREATE and XATTR_REPLACE.
+ */
+int zramfs_xattr_set(struct inode *inode, int index, const char *name, const void *value, size_t size, int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct zramfs_inode_info *info = ZRAMFS_I(inode);
+	struct gza_inode *ginode = &info->ginode;
+	int bsize = sb->s_blocksize;
+	struct zramfs_xattr_entry *e = NULL;
+	char inl[ZRAMFS_XATTR_INLINE_SIZE];
+	char *all, *buf;
+	int name_len, len, ilen, blen;
+	int found = 0;
+	u32 old;
+	u32 block = 0;
+	int err;
+
+	if (!name)
+		return -EINVAL;
+	if (!xattr_supported(inode))
+		return -EOPNOTSUPP;
+	name_len = strlen(name);
+	if (name_len > 255)
+		return -ERANGE;
+	if (value && (size > 0xffff || sizeof(*e) + name_len + size > bsize - XATTR_HDR))
+		return -ENOSPC;
+	//the old entries and the new one, then the block
+	all = kmalloc(ZRAMFS_XATTR_INLINE_SIZE + 3 * bsize, GFP_NOFS);
+	if (!all)
+		return -ENOMEM;
+	buf = all + ZRAMFS_XATTR_INLINE_SIZE + 2 * bsize;
+
+	down_write(&info->xattr_sem);
+	//all entries but the one of name, then the new one
+	len = xattr_copy(all, ginode->xattr, ZRAMFS_XATTR_INLINE_SIZE, index, name, name_len, &found);
+	if (ginode->xattr_block) {
+		err = xattr_read_block(sb, ginode->xattr_block, buf);
+		if (err)
+			goto out;
+		len += xattr_copy(all + len, buf + XATTR_HDR, bsize - XATTR_HDR,
+				index, name, name_len, &found);
+	}
+	err = -EEXIST;
+	if (found && (flags & XATTR_CREATE))
+		goto out;
+	err = -ENODATA;
+	if (!found && (flags & XATTR_REPLACE))
+		goto out;
+	if (value) {
+		e = (struct zramfs_xattr_entry *)(all + len);
+		e->e_index = index;
+		e->e_name_len = name_len;
+		e->e_value_len = size;
+		memcpy(e->e_name, name, name_len);
+		memcpy(e->e_name + name_len, value, size);
+		len += XATTR_ENTRY_LEN(e);
+	}
+
+	//each entry in the inode if it still fits, else in the block
+	memset(inl, 0, sizeof(inl));
+	memset(buf, 0, bsize);
+	ilen = 0;
+	blen = XATTR_HDR;
+	err = -ENOSPC;
+	e = NULL;
+	while ((e = xattr_next(all, all + len, e)) != NULL) {
+		if (ilen + XATTR_ENTRY_LEN(e) <= ZRAMFS_XATTR_INLINE_SIZE) {
+			memcpy(inl + ilen, e, XATTR_ENTRY_LEN(e));
+			ilen += XATTR_ENTRY_LEN(e);
+		} else if (blen + XATTR_ENTRY_LEN(e) <= bsize) {
+			memcpy(buf + blen, e, XATTR_ENTRY_LEN(e));
+			blen += XATTR_ENTRY_LEN(e);
+		} else {
+			goto out;
+		}
+	}
+	if (blen > XATTR_HDR) {
+		err = xattr_block_get(inode, buf, &block);
+		if (err)
+			goto out;
+	}
+	//the new block is written before the inode points to it
+	old = ginode->xattr_block;
+	memcpy(ginode->xattr, inl, sizeof(inl));
+	ginode->xattr_block = block;
+	inode->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(inode);
+	zramfs_xattr_release(sb, old);
+	err = 0;
+out:
+	up_write(&info->xattr_sem);
+	kfree(all);
+	return err;
+}
+
+static struct xattr_handler *xattr_handler(int index);
+
+/**
+ * names of all attributes, each prefixed and nul terminated
+ */
+ssize_t zramfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
+{
+	struct inode *inode = dentry->d_inode;
+	struct zramfs_inode_info *info = ZRAMFS_I(inode);
+	struct gza_inode *ginode = &info->ginode;
+	int bsize = inode->i_sb->s_blocksize;
+	struct zramfs_xattr_entry *e = NULL;
+	struct xattr_handler *handler;
+	char *area = ginode->xattr;
+	int len = ZRAMFS_XATTR_INLINE_SIZE;
+	char *buf = NULL;
+	size_t total = 0;
+	size_t n;
+	ssize_t err;
+
+	if (!xattr_supported(inode))
+		return -EOPNOTSUPP;
+	down_read(&info->xattr_sem);
+	if (ginode->xattr_block) {
+		err = -ENOMEM;
+		buf = kmalloc(bsize, GFP_NOFS);
+		if (!buf)
+			goto out;
+		err = xattr_read_block(inode->i_sb, ginode->xattr_block, buf);
+		if (err)
+			goto out;
+	}
+	for (;;) {
+		e = xattr_next(area, area + len, e);
+		if (!e) {
+			if (!buf || area == buf + XATTR_HDR)
+				break;
+			area = buf + XATTR_HDR;
+			len = bsize - XATTR_HDR;
+			continue;
+		}
+		handler = xattr_handler(e->e_index);
+		if (!handler)
+			continue;
+		n = handler->list(inode, buffer ? buffer + total : NULL, size - total,
+				e->e_name, e->e_name_len);
+		err = -ERANGE;
+		if (buffer && total + n > size)
+			goto out;
+		total += n;
+	}
+	err = total;
+out:
+	up_read(&info->xattr_sem);
+	kfree(buf);
+	return err;
+}
+
+/**
+ * the security label of a new inode, on volumes that have room for it
+ */
+int zramfs_init_security(struct inode *inode, struct inode *dir)
+{
+	char *name;
+	void *value;
+	size_t len;
+	int err;
+
+	if (!xattr_supported(inode))
+		return 0;
+	err = security_inode_init_security(inode, dir, &name, &value, &len);
+	if (err)
+		return err == -EOPNOTSUPP ? 0 : err;
+	err = zramfs_xattr_set(inode, ZRAMFS_XATTR_INDEX_SECURITY, name, value, len, 0);
+	kfree(name);
+	kfree(value);
+	return err;
+}
+
+void zramfs_xattr_put_super(struct super_block *sb)
+{
+	struct ramfs_fs_info *fsi = sb->s_fs_info;
+	struct zramfs_xattr_cached *c;
+	struct hlist_node *pos, *n;
+	int i;
+
+	for (i = 0; i < ZRAMFS_XATTR_CACHE_SIZE; i++) {
+		hlist_for_each_entry_safe(c, pos, n, &fsi->xattr_cache[i], node) {
+			hlist_del(&c->node);
+			kfree(c);
+		}
+	}
+}
+
+static size_t xattr_list_name(const char *prefix, size_t prefix_len, char *list,
+		size_t list_size, const char *name, size_t name_len)
+{
+	size_t total = prefix_len + name_len + 1;
+
+	if (list && total <= list_size) {
+		memcpy(list, prefix, prefix_len);
+		memcpy(list + prefix_len, name, name_len);
+		list[prefix_len + name_len] = '\0';
+	}
+	return total;
+}
+
+static size_t zramfs_xattr_user_list(struct inode *inode, char *list, size_t list_size,
+		const char *name, size_t name_len)
+{
+	return xattr_list_name(XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN, list, list_size,
+			name, name_len);
+}
+
+static int zramfs_xattr_user_get(struct inode *inode, const char *name, void *buffer, size_t size)
+{
+	if (!*name)
+		return -EINVAL;
+	return zramfs_xattr_get(inode, ZRAMFS_XATTR_INDEX_USER, name, buffer, size);
+}
+
+static int zramfs_xattr_user_set(struct inode *inode, const char *name, const void *value,
+		size_t size, int flags)
+{
+	if (!*name)
+		return -EINVAL;
+	return zramfs_xattr_set(inode, ZRAMFS_XATTR_INDEX_USER, name, value, size, flags);
+}
+
+static size_t zramfs_xattr_trusted_list(struct inode *inode, char *list, size_t list_size,
+		const char *name, size_t name_len)
+{
+	if (!capable(CAP_SYS_ADMIN))
+		return 0;
+	return xattr_list_name(XATTR_TRUSTED_PREFIX, XATTR_TRUSTED_PREFIX_LEN, list, list_size,
+			name, name_len);
+}
+
+static int zramfs_xattr_trusted_get(struct inode *inode, const char *name, void *buffer, size_t size)
+{
+	if (!*name)
+		return -EINVAL;
+	return zramfs_xattr_get(inode, ZRAMFS_XATTR_INDEX_TRUSTED, name, buffer, size);
+}
+
+static int zramfs_xattr_trusted_set(struct inode *inode, const char *name, const void *value,
+		size_t size, int flags)
+{
+	if (!*name)
+		return -EINVAL;
+	return zramfs_xattr_set(inode, ZRAMFS_XATTR_INDEX_TRUSTED, name, value, size, flags);
+}
+
+static size_t zramfs_xattr_security_list(struct inode *inode, char *list, size_t list_size,
+		const char *name, size_t name_len)
+{
+	return xattr_list_name(XATTR_SECURITY_PREFIX, XATTR_SECURITY_PREFIX_LEN, list, list_size,
+			name, name_len);
+}
+
+static int zramfs_xattr_security_get(struct inode *inode, const char *name, void *buffer, size_t size)
+{
+	if (!*name)
+		return -EINVAL;
+	return zramfs_xattr_get(inode, ZRAMFS_XATTR_INDEX_SECURITY, name, buffer, size);
+}
+
+static int zramfs_xattr_security_set(struct inode *inode, const char *name, const void *value,
+		size_t size, int flags)
+{
+	if (!*name)
+		return -EINVAL;
+	return zramfs_xattr_set(inode, ZRAMFS_XATTR_INDEX_SECURITY, name, value, size, flags);
+}
+
+static struct xattr_handler zramfs_xattr_user_handler = {
+	.prefix	= XATTR_USER_PREFIX,
+	.list	= zramfs_xattr_user_list,
+	.get	= zramfs_xattr_user_get,
+	.set	= zramfs_xattr_user_set,
+};
+
+static struct xattr_handler zramfs_xattr_trusted_handler = {
+	.prefix	= XATTR_TRUSTED_PREFIX,
+	.list	= zramfs_xattr_trusted_list,
+	.get	= zramfs_xattr_trusted_get,
+	.set	= zramfs_xattr_trusted_set,
+};
+
+static struct xattr_handler zramfs_xattr_security_handler = {
+	.prefix	= XATTR_SECURITY_PREFIX,
+	.list	= zramfs_xattr_security_list,
+	.get	= zramfs_xattr_security_get,
+	.set	= zramfs_xattr_security_set,
+};
+
+struct xattr_handler *zramfs_xattr_handlers[] = {
+	&zramfs_xattr_user_handler,
+	&zramfs_xattr_trusted_handler,
+	&zramfs_xattr_security_handler,
+	NULL
+};
+
+static struct xattr_handler *xattr_handler(int index)
+{
+	switch (index) {
+	case ZRAMFS_XATTR_INDEX_USER:
+		return &zramfs_xattr_user_handler;
+	case ZRAMFS_XATTR_INDEX_TRUSTED:
+		return &zramfs_xattr_trusted_handler;
+	case ZRAMFS_XATTR_INDEX_SECURITY:
+		return &zramfs_xattr_security_handler;
+	}
+	return NULL;
+}